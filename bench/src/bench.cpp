@@ -0,0 +1,766 @@
+#include "pch.h"
+#include "newtype.h"
+#include "newtype_manager.h"
+#include "newtype_font.h"
+#include "newtype_text.h"
+
+#include <random>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <unicode/uclean.h>
+
+// Headless benchmarks for the hot paths: glyph rasterization, atlas packing and text updates.
+// Usage: newtype_bench [--iterations N] [--only NAME] font...
+// Prints one JSON object per line, so runs can be diffed and compared by script.
+// Scripts in the text corpus use the first given font that covers them; texts without one are skipped.
+// Exits with 1 if the allocation check finds an update path that keeps allocating,
+// or the Basic Latin fast path shapes anything differently than HarfBuzz does.
+
+// Global operator new and ICU's allocations are counted too, not only what goes through the host,
+// so that the allocation check sees containers and ICU at work
+static std::atomic<uint64_t> g_operatorNew = 0;
+static std::atomic<uint64_t> g_icuAllocations = 0;
+
+void* operator new( size_t size )
+{
+  g_operatorNew.fetch_add( 1, std::memory_order_relaxed );
+  if ( auto address = ::malloc( size ? size : 1 ) )
+    return address;
+  throw std::bad_alloc();
+}
+
+void* operator new[]( size_t size )
+{
+  return ::operator new( size );
+}
+
+void operator delete( void* address ) noexcept
+{
+  ::free( address );
+}
+
+void operator delete[]( void* address ) noexcept
+{
+  ::free( address );
+}
+
+void operator delete( void* address, size_t /*size*/ ) noexcept
+{
+  ::free( address );
+}
+
+void operator delete[]( void* address, size_t /*size*/ ) noexcept
+{
+  ::free( address );
+}
+
+static void* U_CALLCONV icuAllocate( const void* /*context*/, size_t size )
+{
+  g_icuAllocations.fetch_add( 1, std::memory_order_relaxed );
+  return ::malloc( size );
+}
+
+static void* U_CALLCONV icuReallocate( const void* /*context*/, void* address, size_t size )
+{
+  g_icuAllocations.fetch_add( 1, std::memory_order_relaxed );
+  return ::realloc( address, size );
+}
+
+static void U_CALLCONV icuFree( const void* /*context*/, void* address )
+{
+  ::free( address );
+}
+
+using namespace newtype;
+
+namespace {
+
+  using Clock = std::chrono::steady_clock;
+
+  inline double secondsSince( Clock::time_point start )
+  {
+    return std::chrono::duration<double>( Clock::now() - start ).count();
+  }
+
+  // Null host on plain malloc, counting everything newtype asks of it
+  class CountingHost: public Host {
+  public:
+    atomic<uint64_t> allocations = 0;
+    atomic<uint64_t> reallocations = 0;
+    atomic<uint64_t> frees = 0;
+    atomic<uint64_t> texturesCreated = 0;
+    atomic<uint64_t> texturesDestroyed = 0;
+    void* newtypeMemoryAllocate( uint32_t size ) override
+    {
+      allocations.fetch_add( 1, std::memory_order_relaxed );
+      return ::malloc( size );
+    }
+    void* newtypeMemoryReallocate( void* address, uint32_t newSize ) override
+    {
+      reallocations.fetch_add( 1, std::memory_order_relaxed );
+      return ::realloc( address, newSize );
+    }
+    void newtypeMemoryFree( void* address ) override
+    {
+      if ( address )
+        frees.fetch_add( 1, std::memory_order_relaxed );
+      ::free( address );
+    }
+    void newtypeFontTextureCreated( Font& /*font*/, StyleID /*style*/, Texture& /*texture*/ ) override
+    {
+      texturesCreated.fetch_add( 1, std::memory_order_relaxed );
+    }
+    void newtypeFontTextureDestroyed( Font& /*font*/, StyleID /*style*/, Texture& /*texture*/ ) override
+    {
+      texturesDestroyed.fetch_add( 1, std::memory_order_relaxed );
+    }
+    inline uint64_t hostCalls() const
+    {
+      return ( allocations.load( std::memory_order_relaxed ) + reallocations.load( std::memory_order_relaxed ) );
+    }
+  };
+
+  // One line of JSON output, written out when it goes out of scope
+  class Record {
+  private:
+    string line_;
+  public:
+    explicit Record( const char* bench )
+    {
+      line_ = "{\"bench\":\"";
+      line_ += bench;
+      line_ += "\"";
+    }
+    Record& field( const char* name, const string& value )
+    {
+      line_ += ",\"";
+      line_ += name;
+      line_ += "\":\"";
+      for ( auto c : value )
+      {
+        if ( c == '"' || c == '\\' )
+          line_ += '\\';
+        line_ += c;
+      }
+      line_ += "\"";
+      return *this;
+    }
+    Record& field( const char* name, double value )
+    {
+      char tmp[64];
+      snprintf( tmp, sizeof( tmp ), ",\"%s\":%.6g", name, value );
+      line_ += tmp;
+      return *this;
+    }
+    ~Record()
+    {
+      line_ += "}\n";
+      fputs( line_.c_str(), stdout );
+      fflush( stdout );
+    }
+  };
+
+  struct Percentiles {
+    double p50 = 0.0;
+    double p95 = 0.0;
+    double max = 0.0;
+  };
+
+  Percentiles percentiles( vector<double>& samples )
+  {
+    Percentiles result;
+    if ( samples.empty() )
+      return result;
+    std::sort( samples.begin(), samples.end() );
+    result.p50 = samples[samples.size() / 2];
+    result.p95 = samples[std::min( samples.size() - 1, ( samples.size() * 95 ) / 100 )];
+    result.max = samples.back();
+    return result;
+  }
+
+  struct BenchFont {
+    string path;
+    FontPtr font;
+    FontFacePtr face;
+  };
+
+  struct Options {
+    size_t iterations = 200;
+    string only;
+    vector<string> fonts;
+  };
+
+  inline bool selected( const Options& options, const char* name )
+  {
+    return ( options.only.empty() || options.only == name );
+  }
+
+  // RASTERIZATION =============================================================
+
+  void benchRasterize( ManagerImpl& manager, CountingHost& host, const BenchFont& source, FontRendering rendering, Real thickness, const Options& options )
+  {
+    // Every round gets a fresh font with a face at a slightly different size, and so a fresh style and atlas,
+    // all unloaded again once measured. Sizes start above the 16 the texts use, which would share their face otherwise.
+    const size_t target = std::max( options.iterations * 20, static_cast<size_t>( 1000 ) );
+    const string atlasFull = "Font face texture atlas is full";
+    size_t glyphs = 0;
+    size_t atlases = 0;
+    double seconds = 0.0;
+    string error;
+    const auto callsBefore = host.hostCalls();
+
+    for ( Real size = 17.0f; glyphs < target && error.empty(); size += 0.25f )
+    {
+      auto font = manager.createFont();
+      auto face = manager.loadFaceFromFile( font, source.path, 0, size );
+      auto impl = static_cast<FontFaceImpl*>( face.get() );
+      auto styleID = manager.loadStyle( face, rendering, thickness );
+      auto style = static_cast<FontStyleImpl*>( impl->getStyle( styleID ).get() );
+      auto ftFace = impl->ftFace();
+      const auto count = static_cast<GlyphIndex>( ftFace->num_glyphs );
+      if ( count >= 2 )
+      {
+        ++atlases;
+        const auto start = Clock::now();
+        try
+        {
+          for ( GlyphIndex index = 1; index < count && glyphs < target; ++index, ++glyphs )
+            style->getGlyph( manager.ft(), ftFace, index );
+        }
+        catch ( std::exception& e )
+        {
+          // A full atlas just ends the round, anything else ends the bench
+          if ( e.what() != atlasFull )
+            error = e.what();
+        }
+        seconds += secondsSince( start );
+      }
+      // Done with this round's face, style and atlas
+      face.reset();
+      manager.unloadFont( font );
+      if ( count < 2 )
+        break;
+    }
+
+    Record record( "rasterize" );
+    record
+      .field( "font", source.path )
+      .field( "rendering", rendering == FontRender_Normal ? string( "normal" ) : string( "outline" ) )
+      .field( "glyphs", static_cast<double>( glyphs ) )
+      .field( "atlases", static_cast<double>( atlases ) )
+      .field( "seconds", seconds )
+      .field( "glyphs_per_sec", seconds > 0.0 ? glyphs / seconds : 0.0 )
+      .field( "host_calls", static_cast<double>( host.hostCalls() - callsBefore ) );
+    if ( !error.empty() )
+      record.field( "error", error );
+  }
+
+  // ATLAS PACKING =============================================================
+
+  struct GlyphSizeMix {
+    const char* name;
+    vector<Real> pixelSizes;
+    Real widthRatio; // mean glyph width relative to the pixel size
+    Real heightRatio;
+    Real spread; // relative standard deviation
+  };
+
+  void benchAtlas( const GlyphSizeMix& mix, const Options& options )
+  {
+    std::mt19937 random( 1234 );
+    std::normal_distribution<Real> jitter( 1.0f, mix.spread );
+    std::uniform_int_distribution<size_t> pick( 0, mix.pixelSizes.size() - 1 );
+
+    const size_t rounds = std::max( options.iterations / 10, static_cast<size_t>( 5 ) );
+    size_t regions = 0;
+    double seconds = 0.0;
+    double occupancy = 0.0;
+    double fragmentation = 0.0;
+    double nodes = 0.0;
+
+    for ( size_t round = 0; round < rounds; ++round )
+    {
+      // Sizes are drawn up front so that only packing is timed
+      vector<pair<uint32_t, uint32_t>> sizes( 8192 );
+      for ( auto& size : sizes )
+      {
+        const auto pixels = mix.pixelSizes[pick( random )];
+        size.first = static_cast<uint32_t>( std::max( 1.0f, pixels * mix.widthRatio * jitter( random ) ) ) + 1;
+        size.second = static_cast<uint32_t>( std::max( 1.0f, pixels * mix.heightRatio * jitter( random ) ) ) + 1;
+      }
+
+      TextureAtlas atlas( vec2i( 1024 ), 1 );
+      const auto start = Clock::now();
+      for ( const auto& size : sizes )
+      {
+        if ( atlas.getRegion( size.first, size.second ).x < 0 )
+          break;
+        ++regions;
+      }
+      seconds += secondsSince( start );
+      occupancy += static_cast<double>( atlas.used() ) / ( 1024.0 * 1024.0 );
+      fragmentation += atlas.fragmentation();
+      nodes += static_cast<double>( atlas.skylineNodes() );
+    }
+
+    Record( "atlas" )
+      .field( "mix", mix.name )
+      .field( "atlases", static_cast<double>( rounds ) )
+      .field( "regions", static_cast<double>( regions ) )
+      .field( "seconds", seconds )
+      .field( "regions_per_sec", seconds > 0.0 ? regions / seconds : 0.0 )
+      .field( "occupancy", occupancy / rounds )
+      .field( "fragmentation", fragmentation / rounds )
+      .field( "skyline_nodes", nodes / rounds );
+  }
+
+  // TEXT UPDATES ==============================================================
+
+  struct CorpusEntry {
+    const char* script;
+    Codepoint probe; // a codepoint the font must have
+    const char* text;
+  };
+
+  const CorpusEntry c_corpus[] = {
+    { "latin", 'a',
+      "The quick brown fox jumps over the lazy dog. Pack my box with five dozen liquor jugs. "
+      "Sphinx of black quartz, judge my vow! How vexingly quick daft zebras jump; waltz, bad nymph, for quick jigs vex. "
+      "Amazingly few discotheques provide jukeboxes, and the five boxing wizards jump quickly." },
+    { "cyrillic", 0x0436,
+      "Съешь же ещё этих мягких французских булок, да выпей чаю. "
+      "В чащах юга жил бы цитрус? Да, но фальшивый экземпляр! "
+      "Эх, чужак, общий съём цен шляп (юфть) — вдрызг! Широкая электрификация южных губерний даст мощный толчок подъёму сельского хозяйства." },
+    { "arabic", 0x0628,
+      "نص حكيم له سر قاطع وذو شأن عظيم مكتوب على ثوب أخضر ومغلف بجلد أزرق. "
+      "صِف خَلقَ خَودِ كَمِثلِ الشَمسِ إِذ بَزَغَت يَحظى الضَجيعُ بِها نَجلاءَ مِعطارِ. "
+      "العلم نور والجهل ظلام، ومن جد وجد ومن زرع حصد." },
+    { "cjk", 0x5929,
+      "天地玄黄，宇宙洪荒。日月盈昃，辰宿列张。寒来暑往，秋收冬藏。闰余成岁，律吕调阳。"
+      "云腾致雨，露结为霜。金生丽水，玉出昆冈。剑号巨阙，珠称夜光。果珍李柰，菜重芥姜。"
+      "海咸河淡，鳞潜羽翔。龙师火帝，鸟官人皇。始制文字，乃服衣裳。推位让国，有虞陶唐。" },
+  };
+
+  // Which of the given fonts covers a codepoint, checked with a FreeType of our own
+  int findCoveringFont( const vector<BenchFont>& fonts, Codepoint probe )
+  {
+    FT_Library library = nullptr;
+    if ( FT_Init_FreeType( &library ) )
+      return -1;
+    int found = -1;
+    for ( size_t i = 0; i < fonts.size() && found < 0; ++i )
+    {
+      FT_Face face = nullptr;
+      if ( FT_New_Face( library, fonts[i].path.c_str(), 0, &face ) )
+        continue;
+      if ( FT_Get_Char_Index( face, probe ) != 0 )
+        found = static_cast<int>( i );
+      FT_Done_Face( face );
+    }
+    FT_Done_FreeType( library );
+    return found;
+  }
+
+  void benchTexts( ManagerImpl& manager, CountingHost& host, const vector<BenchFont>& fonts, const Options& options )
+  {
+    vector<TextPtr> texts;
+    vector<string> variants[2];
+
+    for ( const auto& entry : c_corpus )
+    {
+      const auto fontIndex = findCoveringFont( fonts, entry.probe );
+      if ( fontIndex < 0 )
+      {
+        Record( "text" ).field( "script", entry.script ).field( "skipped", 1.0 );
+        continue;
+      }
+      const auto& source = fonts[fontIndex];
+      auto style = manager.loadStyle( source.face, FontRender_Normal, 0.0f );
+      auto text = manager.createText( source.face, style );
+      text->wrapWidth( 480.0f );
+
+      // Alternating between two versions keeps every update a full reshape, with warm glyph caches
+      const string original = entry.text;
+      const string changed = string( "1 " ) + original;
+
+      text->setText( original );
+      const auto coldStart = Clock::now();
+      text->update();
+      const auto cold = secondsSince( coldStart );
+
+      vector<double> samples;
+      samples.reserve( options.iterations );
+      const auto callsBefore = host.hostCalls();
+      for ( size_t i = 0; i < options.iterations; ++i )
+      {
+        text->setText( ( i & 1 ) ? original : changed );
+        const auto start = Clock::now();
+        text->update();
+        samples.push_back( secondsSince( start ) * 1e6 );
+      }
+      const auto calls = host.hostCalls() - callsBefore;
+      const auto result = percentiles( samples );
+
+      Record( "text" )
+        .field( "script", entry.script )
+        .field( "font", source.path )
+        .field( "bytes", static_cast<double>( original.size() ) )
+        .field( "glyphs", static_cast<double>( text->mesh().vertices_.size() / 4 ) )
+        .field( "cold_us", cold * 1e6 )
+        .field( "p50_us", result.p50 )
+        .field( "p95_us", result.p95 )
+        .field( "max_us", result.max )
+        .field( "host_calls_per_update", static_cast<double>( calls ) / options.iterations );
+
+      texts.push_back( text );
+      variants[0].push_back( original );
+      variants[1].push_back( changed );
+    }
+
+    if ( texts.empty() )
+      return;
+
+    // All scripts at once through the parallel path
+    vector<double> samples;
+    samples.reserve( options.iterations );
+    const auto callsBefore = host.hostCalls();
+    for ( size_t i = 0; i < options.iterations; ++i )
+    {
+      for ( size_t t = 0; t < texts.size(); ++t )
+        texts[t]->setText( variants[i & 1][t] );
+      const auto start = Clock::now();
+      manager.updateTexts( texts );
+      samples.push_back( secondsSince( start ) * 1e6 );
+    }
+    const auto calls = host.hostCalls() - callsBefore;
+    const auto result = percentiles( samples );
+
+    Record( "text_batch" )
+      .field( "texts", static_cast<double>( texts.size() ) )
+      .field( "p50_us", result.p50 )
+      .field( "p95_us", result.p95 )
+      .field( "max_us", result.max )
+      .field( "host_calls_per_update", static_cast<double>( calls ) / options.iterations );
+  }
+
+  // BASIC LATIN FAST PATH =====================================================
+
+  // Every printable pair once, the Latin corpus text and the usual kerning suspects, in each font
+  bool checkFastPath( ManagerImpl& manager, const vector<BenchFont>& fonts )
+  {
+    vector<string> corpus;
+    for ( char first = 0x20; first < 0x7F; ++first )
+    {
+      string pairs;
+      for ( char second = 0x20; second < 0x7F; ++second )
+      {
+        pairs += first;
+        pairs += second;
+      }
+      corpus.push_back( pairs );
+    }
+    corpus.push_back( c_corpus[0].text );
+    corpus.push_back( "AVATAR WAVE Yo Ty Te To LT P. F, V; \"Quote\" 'single' (1,234.50) [x] {y}\nLine two\r\nAnd three" );
+
+    bool passed = true;
+    for ( const auto& source : fonts )
+    {
+      auto text = static_pointer_cast<TextImpl>( manager.createText( source.face, manager.loadStyle( source.face, FontRender_Normal, 0.0f ) ) );
+      FastPathCheck total;
+      for ( const auto& entry : corpus )
+      {
+        text->setText( entry );
+        const auto check = text->checkFastPath();
+        total.runs += check.runs;
+        total.glyphs += check.glyphs;
+        total.mismatches += check.mismatches;
+      }
+
+      Record( "fastpath" )
+        .field( "font", source.path )
+        .field( "texts", static_cast<double>( corpus.size() ) )
+        .field( "fast_runs", static_cast<double>( total.runs ) )
+        .field( "glyphs", static_cast<double>( total.glyphs ) )
+        .field( "mismatches", static_cast<double>( total.mismatches ) );
+
+      passed &= ( total.mismatches == 0 );
+    }
+    return passed;
+  }
+
+  // STEADY STATE ALLOCATIONS ==================================================
+
+  struct AllocationCounts {
+    uint64_t operatorNew = 0;
+    uint64_t icu = 0;
+    uint64_t pools = 0; // FreeType, and HarfBuzz when built to allocate through newtype
+    uint64_t host = 0;
+    inline uint64_t total() const { return ( operatorNew + icu + pools + host ); }
+  };
+
+  AllocationCounts countAllocations( ManagerImpl& manager, CountingHost& host )
+  {
+    const auto memory = manager.memoryStats();
+    AllocationCounts counts;
+    counts.operatorNew = g_operatorNew.load( std::memory_order_relaxed );
+    counts.icu = g_icuAllocations.load( std::memory_order_relaxed );
+    counts.pools = ( memory.poolAllocations + memory.largeAllocations );
+    counts.host = host.hostCalls();
+    return counts;
+  }
+
+  struct AllocationSubject {
+    TextPtr text;
+    string variants[2];
+  };
+
+  // One text per covered script, alternating between two versions so that every update reshapes
+  vector<AllocationSubject> createSubjects( ManagerImpl& manager, const vector<BenchFont>& fonts, const function<void( Text& )>& configure )
+  {
+    vector<AllocationSubject> subjects;
+    for ( const auto& entry : c_corpus )
+    {
+      const auto fontIndex = findCoveringFont( fonts, entry.probe );
+      if ( fontIndex < 0 )
+        continue;
+      const auto& source = fonts[fontIndex];
+      AllocationSubject subject;
+      subject.text = manager.createText( source.face, manager.loadStyle( source.face, FontRender_Normal, 0.0f ) );
+      subject.text->wrapWidth( 480.0f );
+      subject.variants[0] = entry.text;
+      subject.variants[1] = string( "1 " ) + entry.text;
+      configure( *subject.text );
+      subjects.push_back( move( subject ) );
+    }
+    return subjects;
+  }
+
+  // Updates until a whole run of iterations in a row allocates nothing, within a generous warm-up.
+  // Texts settle within a few updates of seeing their largest version; parallel updates once every worker has joined in.
+  bool checkSteadyState( const char* name, ManagerImpl& manager, CountingHost& host, size_t texts, const Options& options, const function<void( size_t )>& step )
+  {
+    const size_t limit = ( options.iterations * 10 + 64 );
+    const auto start = countAllocations( manager, host );
+    auto settled = start;
+    size_t settledAfter = 0;
+    size_t updates = 0;
+    size_t clean = 0;
+    while ( clean < options.iterations && updates < limit )
+    {
+      const auto before = countAllocations( manager, host );
+      step( updates++ );
+      const auto after = countAllocations( manager, host );
+      if ( after.total() != before.total() )
+      {
+        settled = after;
+        settledAfter = updates;
+        clean = 0;
+      }
+      else
+        ++clean;
+    }
+
+    const bool steady = ( clean >= options.iterations );
+    Record( "alloc" )
+      .field( "case", name )
+      .field( "texts", static_cast<double>( texts ) )
+      .field( "updates", static_cast<double>( updates ) )
+      .field( "warmup_updates", static_cast<double>( settledAfter ) )
+      .field( "steady", steady ? 1.0 : 0.0 )
+      .field( "operator_new", static_cast<double>( settled.operatorNew - start.operatorNew ) )
+      .field( "icu", static_cast<double>( settled.icu - start.icu ) )
+      .field( "pools", static_cast<double>( settled.pools - start.pools ) )
+      .field( "host", static_cast<double>( settled.host - start.host ) );
+
+    if ( !steady )
+      fprintf( stderr, "allocation check failed: %s still allocates after %zu updates\n", name, updates );
+    return steady;
+  }
+
+  bool benchAllocations( ManagerImpl& manager, CountingHost& host, const vector<BenchFont>& fonts, const Options& options )
+  {
+    bool passed = true;
+
+    {
+      auto subjects = createSubjects( manager, fonts, []( Text& /*text*/ ) {} );
+      passed &= checkSteadyState( "update", manager, host, subjects.size(), options, [&]( size_t i ) {
+        for ( auto& subject : subjects )
+        {
+          subject.text->setText( subject.variants[i & 1] );
+          subject.text->update();
+        }
+      } );
+    }
+
+    {
+      auto subjects = createSubjects( manager, fonts, []( Text& text ) {
+        text.meshFormat( MeshFormat_CompactQuads );
+        text.sharedIndices( true );
+        text.clipRect( vec4( 0.0f, -64.0f, 400.0f, 64.0f ) );
+      } );
+      passed &= checkSteadyState( "update_compact_clipped", manager, host, subjects.size(), options, [&]( size_t i ) {
+        for ( auto& subject : subjects )
+        {
+          subject.text->setText( subject.variants[i & 1] );
+          subject.text->pen( vec3( 8.0f, ( i & 2 ) ? -24.0f : 0.0f, 0.0f ) );
+          subject.text->update();
+        }
+      } );
+    }
+
+    {
+      auto subjects = createSubjects( manager, fonts, []( Text& text ) {
+        text.meshFormat( MeshFormat_Instances );
+        text.meshBuffering( true );
+      } );
+      passed &= checkSteadyState( "update_buffered", manager, host, subjects.size(), options, [&]( size_t i ) {
+        for ( auto& subject : subjects )
+        {
+          subject.text->setText( subject.variants[i & 1] );
+          subject.text->update();
+          subject.text->consumeMesh();
+        }
+      } );
+    }
+
+    {
+      auto subjects = createSubjects( manager, fonts, []( Text& /*text*/ ) {} );
+      vector<uint8_t> destination( 1 << 20 );
+      passed &= checkSteadyState( "update_into", manager, host, subjects.size(), options, [&]( size_t i ) {
+        for ( auto& subject : subjects )
+        {
+          subject.text->setText( subject.variants[i & 1] );
+          subject.text->updateInto( destination, nullptr );
+        }
+      } );
+    }
+
+    {
+      auto subjects = createSubjects( manager, fonts, []( Text& /*text*/ ) {} );
+      vector<TextPtr> texts;
+      for ( const auto& subject : subjects )
+        texts.push_back( subject.text );
+      passed &= checkSteadyState( "update_texts", manager, host, subjects.size(), options, [&]( size_t i ) {
+        for ( auto& subject : subjects )
+          subject.text->setText( subject.variants[i & 1] );
+        manager.updateTexts( texts );
+      } );
+    }
+
+    {
+      auto subjects = createSubjects( manager, fonts, []( Text& /*text*/ ) {} );
+      auto batch = manager.createBatch( MeshFormat_Quads );
+      for ( const auto& subject : subjects )
+        batch->add( subject.text );
+      passed &= checkSteadyState( "text_batch", manager, host, subjects.size(), options, [&]( size_t i ) {
+        for ( auto& subject : subjects )
+          subject.text->setText( subject.variants[i & 1] );
+        batch->update();
+        batch->markClean();
+      } );
+    }
+
+    return passed;
+  }
+
+}
+
+int main( int argc, char** argv )
+{
+  Options options;
+  for ( int i = 1; i < argc; ++i )
+  {
+    const string arg = argv[i];
+    if ( arg == "--iterations" && i + 1 < argc )
+      options.iterations = std::max( static_cast<size_t>( std::strtoul( argv[++i], nullptr, 10 ) ), static_cast<size_t>( 1 ) );
+    else if ( arg == "--only" && i + 1 < argc )
+      options.only = argv[++i];
+    else
+      options.fonts.push_back( arg );
+  }
+
+  if ( options.fonts.empty() )
+  {
+    fprintf( stderr, "usage: %s [--iterations N] [--only rasterize|atlas|text|fastpath|alloc] font...\n", argv[0] );
+    return 1;
+  }
+
+  // Has to come before anything else uses ICU
+  UErrorCode status = U_ZERO_ERROR;
+  u_setMemoryFunctions( nullptr, icuAllocate, icuReallocate, icuFree, &status );
+
+  CountingHost host;
+  int result = 0;
+  {
+    ManagerImpl manager( &host );
+    manager.initialize();
+
+    Record( "info" )
+      .field( "version", manager.versionString() )
+      .field( "iterations", static_cast<double>( options.iterations ) );
+
+    vector<BenchFont> fonts;
+    try
+    {
+      for ( const auto& path : options.fonts )
+      {
+        BenchFont font;
+        font.path = path;
+        font.font = manager.createFont();
+        font.face = manager.loadFaceFromFile( font.font, path, 0, 16.0f );
+        fonts.push_back( move( font ) );
+      }
+
+      if ( selected( options, "rasterize" ) )
+      {
+        for ( const auto& source : fonts )
+        {
+          benchRasterize( manager, host, source, FontRender_Normal, 0.0f, options );
+          benchRasterize( manager, host, source, FontRender_Outline_Expand, 1.5f, options );
+        }
+      }
+
+      if ( selected( options, "atlas" ) )
+      {
+        const GlyphSizeMix mixes[] = {
+          { "ui_latin", { 12.0f, 14.0f, 16.0f, 18.0f, 24.0f }, 0.55f, 0.75f, 0.25f },
+          { "cjk", { 14.0f, 16.0f, 20.0f, 24.0f }, 0.95f, 0.95f, 0.08f },
+          { "headings", { 32.0f, 48.0f, 64.0f }, 0.6f, 0.8f, 0.25f }
+        };
+        for ( const auto& mix : mixes )
+          benchAtlas( mix, options );
+      }
+
+      if ( selected( options, "text" ) )
+        benchTexts( manager, host, fonts, options );
+
+      if ( selected( options, "fastpath" ) && !checkFastPath( manager, fonts ) )
+        result = 1;
+
+      if ( selected( options, "alloc" ) && !benchAllocations( manager, host, fonts, options ) )
+        result = 1;
+    }
+    catch ( std::exception& e )
+    {
+      fprintf( stderr, "benchmark failed: %s\n", e.what() );
+      result = 1;
+    }
+
+    // Faces have to go before FreeType does, failed run or not
+    for ( auto& font : fonts )
+      manager.unloadFont( font.font );
+    fonts.clear();
+
+    manager.shutdown();
+  }
+
+  Record( "host" )
+    .field( "allocations", static_cast<double>( host.allocations.load() ) )
+    .field( "reallocations", static_cast<double>( host.reallocations.load() ) )
+    .field( "frees", static_cast<double>( host.frees.load() ) )
+    .field( "textures_created", static_cast<double>( host.texturesCreated.load() ) )
+    .field( "textures_destroyed", static_cast<double>( host.texturesDestroyed.load() ) );
+
+  return result;
+}
\ No newline at end of file
@@ -2,19 +2,23 @@
 
 #include "newtype_types.h"
 
-#define NEWTYPE_CALL __stdcall
-
-#ifdef NEWTYPE_EXPORTS
-# define NEWTYPE_EXPORT __declspec( dllexport )
+#ifdef _WIN32
+# define NEWTYPE_CALL __stdcall
+# ifdef NEWTYPE_EXPORTS
+#  define NEWTYPE_EXPORT __declspec( dllexport )
+# else
+#  define NEWTYPE_EXPORT __declspec( dllimport )
+# endif
 #else
-# define NEWTYPE_EXPORT __declspec( dllimport )
+# define NEWTYPE_CALL
+# define NEWTYPE_EXPORT __attribute__( ( visibility( "default" ) ) )
 #endif
 
 namespace newtype {
 
   // Current library version;
   // Pass this to Initialize()
-  constexpr uint32_t c_headerVersion = 2;
+  constexpr uint32_t c_headerVersion = 3;
 
   constexpr int c_dpi = 72;
 
@@ -54,6 +58,37 @@ namespace newtype {
 
   using Vertices = vector<Vertex>;
   using Indices = vector<VertexIndex>;
+  using IndicesPtr = shared_ptr<const Indices>;
+
+  // Quantized vertex for 2D text: whole pixel positions relative to Mesh::translation_,
+  // unorm16 texcoords and RGBA8 color, in 12 bytes instead of 36
+#pragma pack( push, 1 )
+  struct CompactVertex {
+    int16_t position[2];
+    uint16_t texcoord[2];
+    uint32_t color; // RGBA8, red in the lowest byte
+  };
+#pragma pack( pop )
+
+  using CompactVertices = vector<CompactVertex>;
+
+  // One glyph quad for instanced drawing, expanded to its corners by the host's vertex shader
+#pragma pack( push, 1 )
+  struct GlyphInstance {
+    vec3 position; // top left corner
+    vec2 size;
+    vec4 texcoords; // top left and bottom right
+    uint32_t color; // RGBA8, red in the lowest byte
+  };
+#pragma pack( pop )
+
+  using GlyphInstances = vector<GlyphInstance>;
+
+  enum MeshFormat {
+    MeshFormat_Quads = 0, // four Vertex records and six indices per glyph
+    MeshFormat_Instances, // one GlyphInstance per glyph
+    MeshFormat_CompactQuads // four CompactVertex records and six indices per glyph; always uses PenMode_Translation
+  };
 
   enum TextureFormat {
     TextureFormat_R8,
@@ -71,10 +106,26 @@ namespace newtype {
     virtual void markClean() = 0;
   };
 
+  // Range of a mesh's glyphs that draws from one atlas texture
+  struct MeshGroup {
+    const Texture* texture;
+    size_t first; // in glyphs; four vertices and six indices each, or one instance
+    size_t count;
+  };
+
+  using MeshGroups = vector<MeshGroup>;
+
   class Mesh {
   public:
-    Vertices vertices_;
-    Indices indices_;
+    MeshFormat format_ = MeshFormat_Quads;
+    Vertices vertices_; // MeshFormat_Quads
+    Indices indices_; // MeshFormat_Quads, MeshFormat_CompactQuads
+    CompactVertices compactVertices_; // MeshFormat_CompactQuads
+    GlyphInstances instances_; // MeshFormat_Instances
+    MeshGroups groups_; // one per texture, in drawing order
+    vec3 translation_ = vec3( 0.0f ); // pen offset for the host to apply, see PenMode_Translation
+    bool sharedIndices_ = false; // indices_ is left empty, draw with quadIndices_ instead
+    IndicesPtr quadIndices_; // with sharedIndices_, the Manager::quadIndices() snapshot covering this mesh
     bool dirty_ = true;
   };
 
@@ -82,13 +133,53 @@ namespace newtype {
 
   class Font;
 
+  // Lets newtype's parallel work run on the host's job system instead of threads of its own
+  class JobHost {
+  public:
+    using JobFunction = void( NEWTYPE_CALL* )( void* context );
+    using JobHandle = uint64_t;
+    // How many jobs may usefully run at once, not counting the thread that waits for them
+    virtual uint32_t newtypeJobWorkerCount() = 0;
+    virtual JobHandle newtypeJobSubmit( JobFunction function, void* context ) = 0;
+    // May run other work meanwhile, but must not return before the job has finished
+    virtual void newtypeJobWait( JobHandle job ) = 0;
+  };
+
+  // Stages timed in builds with NEWTYPE_PROFILING defined. Zones nest, so times are inclusive:
+  // building a mesh may shape, and may load, render and pack glyphs not cached yet.
+  enum ProfileZone {
+    ProfileZone_OpenFace = 0, // parsing a face on first use
+    ProfileZone_Shape, // HarfBuzz or the Basic Latin fast path
+    ProfileZone_Layout, // line breaking and layout
+    ProfileZone_LoadGlyph, // FT_Load_Glyph
+    ProfileZone_RenderGlyph, // FT_Render_Glyph, or stroking for outlines
+    ProfileZone_PackGlyph, // atlas packing and copying the bitmap in
+    ProfileZone_BuildMesh, // gathering glyph quads and emitting vertices
+    ProfileZone_Count
+  };
+
+  struct ProfileStats {
+    uint64_t calls[ProfileZone_Count];
+    uint64_t nanoseconds[ProfileZone_Count];
+  };
+
+  // Memory callbacks may be called from worker threads during Manager::updateTexts()
   class Host {
   public:
     virtual void* newtypeMemoryAllocate( uint32_t size ) = 0;
     virtual void* newtypeMemoryReallocate( void* address, uint32_t newSize ) = 0;
     virtual void newtypeMemoryFree( void* address ) = 0;
+    // A style's texture is created when the style is first drawn, not when it's loaded.
+    // Fonts loaded from identical data share their textures. Those are reported for the font that
+    // first loaded the data, or for one still sharing them after that font was unloaded.
+    // No locks are held during the call, so the host is free to use the style from inside it.
     virtual void newtypeFontTextureCreated( Font& font, StyleID style, Texture& texture ) = 0;
     virtual void newtypeFontTextureDestroyed( Font& font, StyleID style, Texture& texture ) = 0;
+    // Null for newtype to start a worker pool of its own when it first needs one
+    virtual JobHost* newtypeJobHost() { return nullptr; }
+    // Forwards NEWTYPE_PROFILING zones to an external profiler, from whichever thread runs them
+    virtual void newtypeZoneBegin( ProfileZone /*zone*/ ) {}
+    virtual void newtypeZoneEnd( ProfileZone /*zone*/ ) {}
   };
 
   enum FontLoadState {
@@ -102,6 +193,12 @@ namespace newtype {
     FontRender_Outline_Expand
   };
 
+  enum FontSource {
+    FontSource_Copied = 0, // copied into host memory by Manager::loadFace
+    FontSource_Blob, // caller's memory, see FontBlob
+    FontSource_Mapped // mapped by Manager::loadFaceFromFile
+  };
+
   class FontStyle {
   public:
     virtual ~FontStyle();
@@ -135,6 +232,52 @@ namespace newtype {
   using FontPtr = shared_ptr<Font>;
   using FontVector = vector<FontPtr>;
 
+  // Font data newtype reads in place instead of copying.
+  // release is called once no face loaded from it is left, or right away if loading fails,
+  // from whichever thread lets go of it last. Leave it null if the data simply outlives the font.
+  struct FontBlob {
+    using ReleaseFunction = void( NEWTYPE_CALL* )( void* context, const uint8_t* data, size_t size );
+    span<const uint8_t> data;
+    ReleaseFunction release = nullptr;
+    void* context = nullptr;
+  };
+
+  class Text;
+
+  // Receives meshes written straight into host memory, such as a persistently mapped buffer region
+  class MeshSink {
+  public:
+    // Called when the current destination of Text::updateInto() is full.
+    // Return a new region with room for at least `required` more elements,
+    // or an empty span to stop writing. What was written so far stays where it is.
+    virtual span<uint8_t> newtypeMeshSpace( Text& text, size_t written, size_t required ) = 0;
+  };
+
+  enum PenMode {
+    PenMode_Baked = 0, // pen is baked into vertex positions; moving it translates the existing vertices
+    PenMode_Translation // vertices are pen-relative, pen is exposed in Mesh::translation_ instead
+  };
+
+  enum TextDirection {
+    TextDirection_Auto = 0, // guessed from the script
+    TextDirection_LeftToRight,
+    TextDirection_RightToLeft
+  };
+
+  enum TextAlignment {
+    TextAlignment_Left = 0,
+    TextAlignment_Center,
+    TextAlignment_Right
+  };
+
+  // A stretch of text drawn with its own face, style and color
+  struct TextRun {
+    size_t length; // in code units of the text as set
+    FontFacePtr face; // null for the text's own face and style
+    StyleID style;
+    vec4 color;
+  };
+
   class Text {
   public:
     struct Features {
@@ -144,10 +287,56 @@ namespace newtype {
   public:
     virtual ~Text();
     virtual void setText( const unicodeString& text ) = 0;
+    virtual void setText( string_view utf8 ) = 0;
+    virtual void setText( u16string_view utf16 ) = 0;
+    inline void setText( const char* utf8 ) { setText( string_view( utf8 ) ); }
+    inline void setText( const char16_t* utf16 ) { setText( u16string_view( utf16 ) ); }
+    virtual void setLanguage( string_view language ) = 0; // BCP 47 tag, empty for the process default
+    virtual void setScript( string_view script ) = 0; // ISO 15924 tag such as "Latn", empty to guess from the text
+    virtual void setDirection( TextDirection direction ) = 0;
+    virtual void setFeatures( const Features& features ) = 0;
+    // Runs follow each other from the start of the text; anything they leave uncovered
+    // uses the text's own face, style and color. Empty to drop all runs.
+    virtual void setRuns( span<const TextRun> runs ) = 0;
+    // Updating a text that's no larger than one built before makes no heap allocations, as long as
+    // its glyphs are cached and its faces, styles and features have been shaped with before.
+    // Scratch memory is per thread or pooled, so with Manager::updateTexts() that holds once
+    // every worker has taken part in an update since the largest text was first built.
     virtual void update() = 0;
+    // Like update(), but writes the mesh in the current format straight into host memory
+    // instead of mesh(), returning the number of vertices (or instances) written.
+    // No indices are written; quads are drawn with Manager::quadIndices().
+    virtual size_t updateInto( span<uint8_t> destination, MeshSink* sink ) = 0;
     virtual const Mesh& mesh() const = 0;
+    // Render thread side of mesh buffering: the latest mesh published by update(), which stays
+    // untouched until the next consumeMesh() call. Without buffering, the same as mesh().
+    virtual const Mesh& consumeMesh() = 0;
     virtual vec3 pen() const = 0;
     virtual void pen( const vec3& pen ) = 0;
+    virtual PenMode penMode() const = 0;
+    virtual void penMode( PenMode mode ) = 0;
+    virtual MeshFormat meshFormat() const = 0;
+    virtual void meshFormat( MeshFormat format ) = 0;
+    virtual bool sharedIndices() const = 0;
+    virtual void sharedIndices( bool shared ) = 0;
+    // Triple buffering so one thread can update() while another reads consumeMesh(), without locks.
+    // Set it before the other thread starts reading. Only update() publishes, not updateInto().
+    // With shared indices, draw each mesh with its own Mesh::quadIndices_, which stays valid with the mesh.
+    // Manager::quadIndices() may have moved on to a newer pattern by the time the mesh is read.
+    virtual bool meshBuffering() const = 0;
+    virtual void meshBuffering( bool enabled ) = 0;
+    virtual Real wrapWidth() const = 0;
+    virtual void wrapWidth( Real width ) = 0; // zero disables wrapping
+    virtual TextAlignment alignment() const = 0;
+    virtual void alignment( TextAlignment alignment ) = 0;
+    virtual vec4 color() const = 0;
+    virtual void color( const vec4& color ) = 0;
+    // Glyphs outside the clip rectangle are left out of the mesh and those on its edge are cropped.
+    // Left, top, right and bottom, in the same coordinates as the pen. Setting it enables clipping.
+    virtual vec4 clipRect() const = 0;
+    virtual void clipRect( const vec4& rect ) = 0;
+    virtual bool clipping() const = 0;
+    virtual void clipping( bool enabled ) = 0;
     virtual bool dirty() const = 0;
     virtual FontFacePtr face() = 0;
     virtual StyleID styleid() const = 0;
@@ -158,17 +347,123 @@ namespace newtype {
 
   using TextPtr = shared_ptr<Text>;
 
+  // Gathers many texts into one contiguous vertex (or instance) stream per atlas texture,
+  // so that each page can be drawn at once. Quads are drawn with Manager::quadIndices().
+  class TextBatch {
+  public:
+    struct Page {
+      const Texture* texture;
+      span<const uint8_t> data;
+      size_t elements; // vertices or instances, including degenerate gaps
+      size_t dirtyFirst; // element range rewritten since the last markClean()
+      size_t dirtyCount;
+    };
+  public:
+    virtual ~TextBatch();
+    virtual MeshFormat format() const = 0;
+    // The text is switched to the batch's format with its pen baked, and changing either throws until it's removed.
+    // Only the batch updates it from then on: Text::update(), Text::updateInto() and Manager::updateTexts() throw for it.
+    // A text can only be in one batch at a time.
+    virtual void add( TextPtr text ) = 0;
+    virtual void remove( TextPtr text ) = 0;
+    virtual void update() = 0; // rewrites the ranges of dirty texts only
+    virtual size_t pageCount() const = 0;
+    virtual Page page( size_t index ) const = 0;
+    virtual void markClean() = 0;
+  };
+
+  using TextBatchPtr = shared_ptr<TextBatch>;
+
+  // Allocation counts since the manager was created.
+  // HarfBuzz is only included when it was built to allocate through newtype.
+  struct MemoryStats {
+    uint64_t hostAllocations; // blocks requested from the host by the pools and arenas
+    uint64_t hostFrees;
+    uint64_t poolAllocations; // small blocks served from the pools
+    uint64_t poolFrees;
+    uint64_t largeAllocations; // too large for a pool, passed on to the host
+    int64_t bytesInUse; // handed out and not yet freed
+    int64_t bytesReserved; // held by the pools and arenas
+  };
+
+  struct StyleStats {
+    StyleID id;
+    bool atlasAllocated; // atlases are made when a style is first drawn
+    vec2i atlasSize;
+    size_t atlasBytes; // CPU copy
+    Real atlasOccupancy; // share of the atlas taken by glyphs
+    Real atlasFragmentation; // share of the packed area below the skyline that no glyph uses
+    size_t atlasSkylineNodes;
+    size_t glyphs;
+    size_t glyphBytes; // glyph cache bookkeeping, approximate
+    uint64_t glyphHits; // zero without NEWTYPE_PROFILING, counting them costs too much across threads
+    uint64_t glyphMisses; // lookups that had to rasterize
+  };
+
+  struct FaceStats {
+    FaceID index;
+    Real size;
+    bool opened; // faces are parsed when first used
+    bool shared; // loaded by more than one font, which all report it
+    FontSource source;
+    size_t dataBytes; // shared by every face loaded from the same data
+    size_t shapePlans;
+    uint64_t shapePlanHits;
+    uint64_t shapePlanMisses;
+    vector<StyleStats> styles;
+  };
+
+  struct FontStats {
+    IDType id;
+    vector<FaceStats> faces;
+  };
+
+  // Totals count shared font data, faces and styles once
+  struct ManagerStats {
+    vector<FontStats> fonts;
+    size_t fontDataBytes[3]; // by FontSource
+    size_t atlasBytes;
+    size_t glyphs;
+    size_t glyphBytes;
+    size_t texts; // alive
+    size_t textBytes; // strings, shaping and layout results
+    size_t meshBytes;
+    size_t quadIndexBytes; // Manager::quadIndices()
+    size_t idleShapingBuffers;
+    size_t idleLineBreakers;
+    MemoryStats memory; // FreeType and scratch memory, as from memoryStats()
+  };
+
   class Manager {
   public:
     // Font
     virtual FontPtr createFont() = 0;
+    // Loading throws if the data isn't a font holding faceIndex, but the face is only parsed
+    // when first shaped or measured, which is where anything else wrong with it surfaces.
+    // Copies the buffer, so it may be freed as soon as this returns
     virtual FontFacePtr loadFace( FontPtr font, span<uint8_t> buffer, FaceID faceIndex, Real size ) = 0;
+    virtual FontFacePtr loadFace( FontPtr font, const FontBlob& blob, FaceID faceIndex, Real size ) = 0;
+    // Maps the file into memory read-only; path is UTF-8
+    virtual FontFacePtr loadFaceFromFile( FontPtr font, const string& path, FaceID faceIndex, Real size ) = 0;
     virtual StyleID loadStyle( FontFacePtr face, FontRendering rendering, Real thickness ) = 0;
     virtual void unloadFont( FontPtr font ) = 0;
     // Text
     virtual TextPtr createText( FontFacePtr face, StyleID style ) = 0;
+    virtual TextBatchPtr createBatch( MeshFormat format ) = 0;
+    // Updates many texts at once, shaping them and building their meshes on worker threads.
+    // Each text at most once, and no fonts may be loaded or unloaded until it returns.
+    virtual void updateTexts( span<const TextPtr> texts ) = 0;
+    // Quad index pattern shared by texts using Text::sharedIndices() and by Text::updateInto().
+    // Callable from any thread at any time. The indices never change once handed out; when an update
+    // needs more, a larger pattern replaces them for later calls, covering every mesh built before it returns.
+    virtual IndicesPtr quadIndices() const = 0;
     virtual FontVector& fonts() = 0;
     virtual const string& versionString() const = 0;
+    virtual MemoryStats memoryStats() const = 0;
+    // Walks every font, face, style and text; call it between updates, not during them
+    virtual ManagerStats stats() const = 0;
+    // Zone totals since the last call, such as once per frame. All zeroes without NEWTYPE_PROFILING.
+    virtual ProfileStats collectProfile() = 0;
   };
 
   using fnNewtypeInitialize = Manager* ( NEWTYPE_CALL* )( uint32_t version, Host* host );
@@ -178,8 +473,8 @@ namespace newtype {
 #if defined(NEWTYPE_EXCEPT)
 # error NEWTYPE_EXCEPT* macro already defined!
 #else
-# define NEWTYPE_EXCEPT(description) {throw std::exception(description);}
-# define NEWTYPE_FREETYPE_EXCEPT(description,retval) {throw std::exception(description);}
+# define NEWTYPE_EXCEPT(description) {throw std::runtime_error(description);}
+# define NEWTYPE_FREETYPE_EXCEPT(description,retval) {throw std::runtime_error(description);}
 #endif
 #endif
 
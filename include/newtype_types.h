@@ -2,6 +2,7 @@
 
 // STL
 #include <exception>
+#include <stdexcept>
 #include <memory>
 #include <vector>
 #include <list>
@@ -66,12 +67,15 @@
 // Harfbuzz
 #include <hb.h>
 #include <hb-ft.h>
+#include <hb-ot.h>
+#include <hb-aat.h>
 #include <hb-icu.h>
 
 #endif
 
 namespace newtype {
 
+  using std::int16_t;
   using std::uint8_t;
   using std::uint16_t;
   using std::uint32_t;
@@ -79,9 +83,11 @@ namespace newtype {
 
   using std::string;
   using std::wstring;
+  using std::u16string;
   using std::stringstream;
   using std::wstringstream;
   using std::string_view;
+  using std::u16string_view;
 
   using std::array;
   using std::vector;
@@ -89,6 +95,7 @@ namespace newtype {
   using std::map;
   using std::make_shared;
   using std::shared_ptr;
+  using std::weak_ptr;
   using std::make_unique;
   using std::unique_ptr;
 
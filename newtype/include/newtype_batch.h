@@ -0,0 +1,65 @@
+#pragma once
+#include "newtype.h"
+#include "newtype_utils.h"
+
+namespace newtype {
+
+  class ManagerImpl;
+  class TextImpl;
+
+  struct BatchPage {
+    const Texture* texture = nullptr;
+    vector<uint8_t> data;
+    size_t size = 0; // in elements, including gaps
+    size_t gaps = 0; // elements in ranges released by texts that moved or left
+    size_t dirtyFirst = 0;
+    size_t dirtyEnd = 0;
+  };
+
+  // Where a text's glyphs from one texture live
+  struct BatchEntry {
+    const Texture* texture;
+    size_t page;
+    size_t first; // in elements
+    size_t capacity;
+    size_t count;
+  };
+
+  struct BatchText {
+    TextPtr text;
+    vector<BatchEntry> entries; // one per texture the text draws from
+    bool written;
+  };
+
+  class TextBatchImpl: public TextBatch, public MeshSink {
+  private:
+    ManagerImpl* manager_;
+    MeshFormat format_;
+    size_t elementSize_;
+    size_t perQuad_;
+    vector<BatchPage> pages_;
+    vector<BatchText> texts_;
+    vector<TextPtr> staging_; // texts to rewrite in the current update()
+    vector<BatchEntry*> live_; // compact() scratch
+    size_t required_ = 0; // overflow reported by the last updateInto()
+  protected:
+    size_t findPage( const Texture* texture );
+    void touch( BatchPage& page, size_t first, size_t count );
+    void release( BatchEntry& entry );
+    void syncEntries( BatchText& batched, TextImpl* impl );
+    void write( BatchEntry& entry, TextImpl* impl );
+    void compact( size_t pageIndex );
+  public:
+    TextBatchImpl( ManagerImpl* manager, MeshFormat format );
+    MeshFormat format() const override;
+    void add( TextPtr text ) override;
+    void remove( TextPtr text ) override;
+    void update() override;
+    size_t pageCount() const override;
+    Page page( size_t index ) const override;
+    void markClean() override;
+    span<uint8_t> newtypeMeshSpace( Text& text, size_t written, size_t required ) override;
+    virtual ~TextBatchImpl();
+  };
+
+}
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 #include "newtype.h"
 #include "newtype_utils.h"
+#include "newtype_fontdata.h"
 
 namespace newtype {
 
@@ -11,6 +12,13 @@ namespace newtype {
   constexpr float c_fmagic = 64.0f;
   constexpr int c_magic = 64;
 
+  // What texts shape in until told otherwise
+  inline hb_language_t defaultLanguage()
+  {
+    static const auto language = hb_language_from_string( "en", 2 );
+    return language;
+  }
+
   class TextureAtlas: public Texture {
   private:
     vector<vec3i> nodes_;
@@ -28,6 +36,9 @@ namespace newtype {
     void clear();
   public:
     inline int depth() const noexcept { return depth_; }
+    inline size_t used() const noexcept { return used_; }
+    inline size_t skylineNodes() const noexcept { return nodes_.size(); }
+    Real fragmentation() const;
     inline uint8_t* data() { return data_.data(); }
     inline vec2 fdimensions() const { return vec2( static_cast<Real>( size_.x ), static_cast<Real>( size_.y ) ); }
     TextureFormat format() const override;
@@ -54,54 +65,124 @@ namespace newtype {
 
   class FontStyleImpl: public FontStyle {
     friend class ManagerImpl;
+    friend class FontFaceImpl;
     friend class TextImpl;
   private:
-    FontImpl* font_;
+    ManagerImpl* manager_;
+    FontImpl* font_; // the font textures are reported for, null once every font sharing the style is unloaded
     uint32_t storedFaceSize_;
     FT_Long storedFaceIndex_;
     Host* host_;
     FontRendering rendering_;
     Real outlineThickness_;
-    TextureAtlasPtr atlas_;
+    vec2i atlasSize_;
+    TextureAtlasPtr atlas_; // made once the style is first drawn
+    atomic<bool> atlasReady_ = false;
     GlyphMap glyphs_;
+    mutable shared_mutex glyphLock_; // readers look glyphs up, the writer inserts rasterized ones
+    atomic<uint64_t> glyphHits_ = 0; // only counted with NEWTYPE_PROFILING
+    uint64_t glyphMisses_ = 0; // under glyphLock_
     bool dirty_ = false;
   protected:
+    void allocateAtlas();
     void initEmptyGlyph();
     void loadGlyph( FT_Library ft, FT_Face face, GlyphIndex index, bool hinting );
+    void detach();
   public:
     FontStyleImpl( FontImpl* font, FT_Long face, uint32_t size, vec2i atlasSize, Host* host, FontRendering rendering, Real thickness );
     StyleID id() const;
+    bool hasGlyph( GlyphIndex index ) const;
     Glyph* getGlyph( FT_Library ft, FT_Face face, GlyphIndex index );
     bool dirty() const override;
     void markClean() override;
     const Texture& texture() const override;
+    void collectStats( StyleStats& stats ) const;
     virtual ~FontStyleImpl();
   };
 
   using FontStyleMap = map<StyleID, FontStylePtr>;
 
+  struct ShapePlanKey {
+    hb_direction_t direction;
+    hb_script_t script;
+    hb_language_t language;
+    uint64_t features; // hash of the feature list
+    inline bool operator<( const ShapePlanKey& other ) const
+    {
+      if ( direction != other.direction )
+        return direction < other.direction;
+      if ( script != other.script )
+        return script < other.script;
+      if ( language != other.language )
+        return language < other.language;
+      return features < other.features;
+    }
+  };
+
+  using ShapePlanMap = map<ShapePlanKey, hb_shape_plan_t*>;
+
+  // Direct codepoint to glyph, advance and kerning lookups for Basic Latin,
+  // letting simple runs skip HarfBuzz altogether. Only valid for texts shaped as
+  // left-to-right Latin in defaultLanguage() with the default features, which is how its pairs are shaped.
+  // A codepoint is simple when it has a nominal glyph (or is a line break control) that isn't a mark
+  // and no default-on GSUB lookup, or GPOS lookup other than pair adjustment, takes it as input or context.
+  // Faces with AAT morx or kerx tables have no simple codepoints.
+  struct BasicLatinTable {
+    static constexpr Codepoint c_count = 0x80;
+    static constexpr int16_t c_complexPair = numeric_limits<int16_t>::min();
+    static constexpr int16_t c_unknownPair = ( c_complexPair + 1 );
+    bool simple[c_count];
+    GlyphIndex glyphs[c_count];
+    hb_position_t advances[c_count];
+    // Pair adjustments to the first glyph's advance, in 26.6, filled in by FontFaceImpl::basicLatinKern()
+    // as pairs first come up; c_complexPair marks pairs that shaping positions in any other way
+    atomic<int16_t> kerning[c_count * c_count];
+  };
+
   class FontFaceImpl: public FontFace {
     friend class ManagerImpl;
     friend class FontStyleImpl;
     friend class TextImpl;
   private:
-    FontImpl* font_;
+    ManagerImpl* manager_;
+    FontImpl* font_; // whichever font sharing the face is still loaded, null once none are
+    FontDataPtr data_; // released after the face, which reads from it
+    FaceID faceIndex_;
+    mutable std::once_flag opened_;
     FT_Face face_ = nullptr;
     hb_font_t* hbfnt_ = nullptr;
-    Real size_ = 0.0f;
+    ShapePlanMap shapePlans_;
+    mutable mutex shapePlanLock_;
+    uint64_t shapePlanHits_ = 0; // under shapePlanLock_
+    uint64_t shapePlanMisses_ = 0;
+    unique_ptr<BasicLatinTable> basicLatin_;
+    std::once_flag basicLatinBuilt_;
+    Real size_ = 0.0f; // as requested
+    Real height_ = 0.0f;
     Real ascender_ = 0.0f;
     Real descender_ = 0.0f;
     FontStyleMap styles_;
     StyleID loadStyle( FontRendering rendering, Real thickness );
   protected:
+    void probe();
+    void openFace();
     void forceUCS2Charmap();
     void postLoad();
+    void detach();
+    hb_shape_plan_t* shapePlan( const hb_segment_properties_t& props, const vector<hb_feature_t>& features, uint64_t featuresHash );
+    void buildBasicLatinTable();
+    const BasicLatinTable& basicLatin();
+    int16_t basicLatinKern( Codepoint first, Codepoint second );
   public:
-    FontFaceImpl( FontImpl* font, FT_Library ft, FT_Open_Args* args, FaceID faceIndex, Real size );
+    FontFaceImpl( FontImpl* font, FontDataPtr data, FaceID faceIndex, Real size );
+    // Parses the font on first use, from whichever thread gets there first
+    void open() const;
+    inline FT_Face ftFace() { open(); return face_; }
     Real size() const override;
     Real ascender() const override;
     Real descender() const override;
     FontStylePtr getStyle( StyleID id ) override;
+    void collectStats( FaceStats& stats ) const;
     virtual ~FontFaceImpl();
   };
 
@@ -110,6 +191,7 @@ namespace newtype {
   class FontImpl: public Font {
     friend class ManagerImpl;
     friend class FontFaceImpl;
+    friend class FontStyleImpl;
     friend class TextImpl;
   private:
     bool loaded_ = false;
@@ -117,9 +199,8 @@ namespace newtype {
   private:
     ManagerImpl* manager_;
     FontFaceMap faces_;
-    unique_ptr<Buffer> data_;
     IDType id_;
-    FontFacePtr loadFace( span<uint8_t> source, FaceID faceIndex, Real size );
+    FontFacePtr loadFace( FontDataPtr data, FaceID faceIndex, Real size );
     void unload();
   protected:
     void update(); // this will recreate the texture if needed
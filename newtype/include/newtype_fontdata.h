@@ -0,0 +1,54 @@
+#pragma once
+#include "newtype.h"
+#include "newtype_utils.h"
+
+namespace newtype {
+
+  // Font file contents that FreeType reads straight from, for as long as any face loaded from them is open
+  class FontData {
+  public:
+    virtual span<const uint8_t> bytes() const = 0;
+    virtual FontSource source() const = 0;
+    // Path, size and modification time for mapped files, telling them apart without reading them; empty otherwise
+    virtual const string& identity() const { static const string none; return none; }
+    virtual ~FontData() {}
+  };
+
+  using FontDataPtr = shared_ptr<FontData>;
+
+  // Our own copy in host memory, for sources the caller won't keep alive
+  class CopiedFontData: public FontData {
+  private:
+    Buffer buffer_;
+  public:
+    CopiedFontData( Host* host, span<uint8_t> source ): buffer_( host, source ) {}
+    span<const uint8_t> bytes() const override;
+    inline FontSource source() const override { return FontSource_Copied; }
+  };
+
+  // Caller's memory, handed back through the blob's release callback once we're done with it
+  class BlobFontData: public FontData {
+  private:
+    FontBlob blob_;
+  public:
+    explicit BlobFontData( const FontBlob& blob ): blob_( blob ) {}
+    span<const uint8_t> bytes() const override;
+    inline FontSource source() const override { return FontSource_Blob; }
+    ~BlobFontData();
+  };
+
+  // Read-only view of a font file mapped into memory
+  class MappedFontData: public FontData {
+  private:
+    const uint8_t* view_ = nullptr;
+    size_t size_ = 0;
+    string identity_;
+  public:
+    explicit MappedFontData( const string& path );
+    span<const uint8_t> bytes() const override;
+    inline FontSource source() const override { return FontSource_Mapped; }
+    inline const string& identity() const override { return identity_; }
+    ~MappedFontData();
+  };
+
+}
\ No newline at end of file
@@ -0,0 +1,44 @@
+#pragma once
+#include "newtype.h"
+#include "newtype_utils.h"
+
+#include <thread>
+#include <condition_variable>
+
+namespace newtype {
+
+  // Runs index-parallel jobs, with the calling thread joining in, either on the host's
+  // job system or on a fixed set of threads of its own. One job at a time; jobs must not start other jobs.
+  class JobPool {
+  private:
+    JobHost* host_;
+    vector<JobHost::JobHandle> handles_; // host jobs of the current parallelFor()
+    vector<std::thread> workers_;
+    mutex runLock_; // held for the duration of a job
+    mutex lock_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const function<void( size_t )>* job_ = nullptr;
+    size_t count_ = 0;
+    size_t grain_ = 1;
+    atomic<size_t> next_ = 0;
+    size_t pending_ = 0; // workers yet to finish with the current job
+    uint64_t generation_ = 0;
+    bool stopping_ = false;
+    std::exception_ptr error_;
+  protected:
+    void workerMain();
+    void drain();
+    void runOnHost();
+    static void NEWTYPE_CALL hostJob( void* context );
+  public:
+    // Either host is set, or that many threads are started
+    JobPool( JobHost* host, size_t workers );
+    ~JobPool();
+    size_t concurrency() const;
+    // Runs job( i ) for every i in [0, count) and returns once all are done.
+    // The first exception thrown by a job stops the rest and is rethrown here.
+    void parallelFor( size_t count, const function<void( size_t )>& job );
+  };
+
+}
\ No newline at end of file
@@ -1,15 +1,34 @@
 #pragma once
 #include "newtype.h"
+#include "newtype_jobs.h"
+#include "newtype_memory.h"
+#include "newtype_profile.h"
+
+#include <unicode/brkiter.h>
 
 namespace newtype {
 
   class FontImpl;
+  class FontFaceImpl;
+  class FontData;
+  class ShapingBuffer;
+  class LineBreaker;
+  struct GlyphQuads;
 
   class ManagerImpl: public Manager {
     friend class FontImpl;
+    friend class FontFaceImpl;
+    friend class FontStyleImpl;
     friend class TextImpl;
+    friend class TextBatchImpl;
+    friend class ShapingBuffer;
+    friend class LineBreaker;
   private:
     Host* host_;
+    // Declared before anything that allocates through them, so they outlive it
+    MemoryCounters memoryCounters_;
+    PoolAllocator ftPool_; // FreeType's many small allocations
+    ScratchArena rasterScratch_; // glyph bitmap conversion, used under rasterizeLock_
     FT_MemoryRec_ ftMemAllocator_;
     FT_Library freeType_ = nullptr;
     struct FreeTypeVersion {
@@ -25,26 +44,113 @@ namespace newtype {
     } hbVersion_ = { 0 };
     string verstr_;
     FontVector fonts_;
-    IDType fontIndex_ = 0;
-    IDType textIndex_ = 0;
+    // Identical font data loaded twice is kept once, and so are the faces opened from it
+    struct SharedFaceKey {
+      const FontData* data;
+      FaceID index;
+      Real size;
+      inline bool operator<( const SharedFaceKey& other ) const
+      {
+        if ( data != other.data )
+          return data < other.data;
+        if ( index != other.index )
+          return index < other.index;
+        return size < other.size;
+      }
+    };
+    map<uint64_t, vector<weak_ptr<FontData>>> sharedData_; // by hashSample() of the content
+    map<SharedFaceKey, weak_ptr<FontFaceImpl>> sharedFaces_;
+    atomic<IDType> fontIndex_ = 0;
+    atomic<IDType> textIndex_ = 0;
+    mutable mutex shapingBufferLock_;
+    vector<hb_buffer_t*> shapingBuffers_; // idle buffers, one per concurrently shaping thread at most
+    atomic<size_t> shapingLength_ = 0; // most glyphs shaped in one go, idle buffers grow to it when taken
+    mutable mutex quadIndexLock_;
+    IndicesPtr quadIndices_ = make_shared<const Indices>(); // replaced, never modified, so hosts can hold on to it while it grows
+    // Largest mesh build so far, in quads and palette colors; per-thread quad scratch grows to it
+    atomic<size_t> scratchQuads_ = 0;
+    atomic<size_t> scratchColors_ = 0;
+    mutable mutex lineBreakerLock_;
+    vector<icu::BreakIterator*> lineBreakers_; // idle ICU line break iterators
+    mutex rasterizeLock_; // glyph rasterization and atlas packing
+    unique_ptr<JobPool> jobs_; // started on first use
+    mutable mutex textsLock_;
+    vector<weak_ptr<Text>> texts_; // for stats(), pruned as texts come and go
+    size_t textsPruneAt_ = 64;
+    ProfileCounters profile_;
   protected:
-    inline FT_Library ft() { return freeType_; }
+    hb_buffer_t* acquireShapingBuffer();
+    void releaseShapingBuffer( hb_buffer_t* buffer );
+    IndicesPtr reserveQuadIndices( size_t quads ); // returns the pattern it left in place
+    void reserveQuadScratch( GlyphQuads& quads, size_t count, size_t colors );
+    icu::BreakIterator* acquireLineBreaker();
+    void releaseLineBreaker( icu::BreakIterator* breaker );
+    JobPool& jobs();
+    shared_ptr<FontData> findFontData( uint64_t hash, span<const uint8_t> bytes, const string& identity );
+    shared_ptr<FontData> shareFontData( shared_ptr<FontData> data );
+    shared_ptr<FontFaceImpl> findFace( const FontData* data, FaceID faceIndex, Real size );
+    void shareFace( const FontData* data, FaceID faceIndex, Real size, const shared_ptr<FontFaceImpl>& face );
+    // Moves faces the font is unloading but other fonts still share over to one of those,
+    // and detaches the rest from it
+    void handOverFaces( FontImpl* font );
+    // Shapes and lays out dirty texts in parallel and caches the glyphs they're missing,
+    // leaving only their meshes to be built
+    void stageTexts( span<const TextPtr> texts );
+    // Drops what's left staged after a failure, so those texts get shaped again on their next update
+    void unstageTexts( span<const TextPtr> texts );
   public:
     ManagerImpl( Host* host );
     inline Host* host() { return host_; }
+    inline FT_Library ft() { return freeType_; }
+    inline PoolAllocator& freeTypePool() { return ftPool_; }
+    inline ProfileCounters& profileCounters() { return profile_; }
     bool initialize();
     void shutdown();
     ~ManagerImpl();
     // Font overrides
     FontPtr createFont() override;
     FontFacePtr loadFace( FontPtr font, span<uint8_t> buffer, FaceID faceIndex, Real size ) override;
+    FontFacePtr loadFace( FontPtr font, const FontBlob& blob, FaceID faceIndex, Real size ) override;
+    FontFacePtr loadFaceFromFile( FontPtr font, const string& path, FaceID faceIndex, Real size ) override;
     StyleID loadStyle( FontFacePtr face, FontRendering rendering, Real thickness ) override;
     void unloadFont( FontPtr font ) override;
     // Text overrides
     TextPtr createText( FontFacePtr face, StyleID style ) override;
+    TextBatchPtr createBatch( MeshFormat format ) override;
+    void updateTexts( span<const TextPtr> texts ) override;
+    IndicesPtr quadIndices() const override;
     // Other overrides
     const string& versionString() const override;
     FontVector& fonts() override;
+    MemoryStats memoryStats() const override;
+    ManagerStats stats() const override;
+    ProfileStats collectProfile() override;
+  };
+
+  // Borrows a HarfBuzz buffer from the manager's pool for the duration of a scope.
+  class ShapingBuffer {
+  private:
+    ManagerImpl* manager_;
+    hb_buffer_t* buffer_;
+  public:
+    ShapingBuffer( ManagerImpl* manager ): manager_( manager ), buffer_( manager->acquireShapingBuffer() ) {}
+    ~ShapingBuffer() { manager_->releaseShapingBuffer( buffer_ ); }
+    ShapingBuffer( const ShapingBuffer& ) = delete;
+    ShapingBuffer& operator=( const ShapingBuffer& ) = delete;
+    inline hb_buffer_t* get() const { return buffer_; }
+  };
+
+  // Borrows an ICU line break iterator from the manager's pool for the duration of a scope.
+  class LineBreaker {
+  private:
+    ManagerImpl* manager_;
+    icu::BreakIterator* breaker_;
+  public:
+    LineBreaker( ManagerImpl* manager ): manager_( manager ), breaker_( manager->acquireLineBreaker() ) {}
+    ~LineBreaker() { manager_->releaseLineBreaker( breaker_ ); }
+    LineBreaker( const LineBreaker& ) = delete;
+    LineBreaker& operator=( const LineBreaker& ) = delete;
+    inline icu::BreakIterator* get() const { return breaker_; }
   };
 
 }
\ No newline at end of file
@@ -0,0 +1,83 @@
+#pragma once
+#include "newtype.h"
+#include "newtype_utils.h"
+
+namespace newtype {
+
+  // Counters shared by the allocators below, readable from any thread
+  struct MemoryCounters {
+    atomic<uint64_t> hostAllocations = 0;
+    atomic<uint64_t> hostFrees = 0;
+    atomic<uint64_t> poolAllocations = 0;
+    atomic<uint64_t> poolFrees = 0;
+    atomic<uint64_t> largeAllocations = 0;
+    atomic<int64_t> bytesInUse = 0;
+    atomic<int64_t> bytesReserved = 0;
+    void addTo( MemoryStats& stats ) const;
+  };
+
+  // Small blocks in power of two size classes, carved from large chunks and recycled through free lists.
+  // Anything bigger goes straight to the backing allocator. Backed by the host, or by malloc without one.
+  // Every block carries a header, since free() isn't told the size.
+  class PoolAllocator {
+  public:
+    static constexpr size_t c_classCount = 8; // 32 to 4096 bytes, header included
+    static constexpr size_t c_chunkSize = 64 * 1024;
+  private:
+    struct alignas( 16 ) BlockHeader {
+      uint32_t sizeClass; // c_classCount for blocks from the backing allocator
+      uint32_t size; // as requested
+    };
+    struct FreeBlock {
+      FreeBlock* next;
+    };
+    Host* host_;
+    MemoryCounters& counters_;
+    mutex lock_;
+    FreeBlock* freeLists_[c_classCount] = { nullptr };
+    vector<void*> chunks_;
+    uint8_t* cursor_ = nullptr; // unused end of the newest chunk
+    size_t remaining_ = 0;
+    static inline size_t classSize( size_t sizeClass ) { return ( static_cast<size_t>( 32 ) << sizeClass ); }
+  protected:
+    void* backingAllocate( size_t size );
+    void backingFree( void* address );
+    void* carve( size_t sizeClass );
+  public:
+    PoolAllocator( Host* host, MemoryCounters& counters );
+    ~PoolAllocator();
+    void* allocate( size_t size );
+    void* reallocate( void* address, size_t size );
+    void free( void* address );
+  };
+
+  // Bump allocator for temporary data, rewound as a whole once it's no longer needed.
+  // Grows to fit the largest use and then stops asking the host for memory. Not thread-safe.
+  class ScratchArena {
+  private:
+    Host* host_;
+    MemoryCounters& counters_;
+    vector<pair<uint8_t*, size_t>> blocks_;
+    size_t used_ = 0; // in the last block
+  public:
+    ScratchArena( Host* host, MemoryCounters& counters );
+    ~ScratchArena();
+    uint8_t* allocate( size_t size );
+    void reset();
+  };
+
+  // Rewinds a scratch arena at the end of a scope
+  class ScratchScope {
+  private:
+    ScratchArena& arena_;
+  public:
+    explicit ScratchScope( ScratchArena& arena ): arena_( arena ) {}
+    ~ScratchScope() { arena_.reset(); }
+    ScratchScope( const ScratchScope& ) = delete;
+    ScratchScope& operator=( const ScratchScope& ) = delete;
+  };
+
+  // Process-wide counters of the HarfBuzz allocation hooks, see NEWTYPE_HARFBUZZ_ALLOCATOR in memory.cpp
+  const MemoryCounters* harfBuzzMemoryCounters();
+
+}
\ No newline at end of file
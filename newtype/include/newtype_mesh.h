@@ -0,0 +1,44 @@
+#pragma once
+#include "newtype.h"
+#include "newtype_utils.h"
+
+namespace newtype {
+
+  // Glyph quads as structure-of-arrays, so that the kernels can work on several at once.
+  // Gathering fills the glyph origins and metrics, computeQuadCorners() turns them into corners.
+  struct GlyphQuads {
+    vector<Real> originX; // pen position plus shaping offset
+    vector<Real> originY;
+    vector<Real> bearingX;
+    vector<Real> bearingY;
+    vector<Real> width;
+    vector<Real> height;
+    vector<Real> x0; // top left
+    vector<Real> y0;
+    vector<Real> x1; // bottom right
+    vector<Real> y1;
+    vector<Real> u0;
+    vector<Real> v0;
+    vector<Real> u1;
+    vector<Real> v1;
+    vector<uint32_t> color; // index into palette
+    vector<vec4> palette;
+    vector<uint32_t> packedPalette; // palette as RGBA8
+    size_t size() const;
+    void resize( size_t count );
+    void reserve( size_t count, size_t colors );
+  };
+
+  size_t meshElementSize( MeshFormat format );
+  size_t meshElementsPerQuad( MeshFormat format );
+
+  // Corners of quads [first, end), from their origins and glyph metrics
+  void computeQuadCorners( GlyphQuads& quads, size_t first, size_t end );
+
+  // Drops quads in [first, end) outside a left, top, right, bottom rectangle and crops those on its edge.
+  // Returns the new end of the range.
+  size_t clipQuads( GlyphQuads& quads, size_t first, size_t end, const vec4& rect );
+
+  void expandQuads( const GlyphQuads& quads, size_t first, size_t count, MeshFormat format, Real depth, uint8_t* destination );
+
+}
\ No newline at end of file
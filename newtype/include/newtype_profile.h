@@ -0,0 +1,54 @@
+#pragma once
+#include "newtype.h"
+#include "newtype_utils.h"
+
+#include <chrono>
+
+namespace newtype {
+
+  // Totals across threads, read and cleared by Manager::collectProfile()
+  struct ProfileCounters {
+    atomic<uint64_t> calls[ProfileZone_Count] = {};
+    atomic<uint64_t> nanoseconds[ProfileZone_Count] = {};
+    ProfileStats collect();
+  };
+
+#ifdef NEWTYPE_PROFILING
+
+  // Times a zone for its scope and tells the host where it begins and ends
+  class ProfileScope {
+  private:
+    Host* host_;
+    ProfileCounters& counters_;
+    ProfileZone zone_;
+    std::chrono::steady_clock::time_point start_;
+  public:
+    ProfileScope( Host* host, ProfileCounters& counters, ProfileZone zone ): host_( host ), counters_( counters ), zone_( zone )
+    {
+      host_->newtypeZoneBegin( zone_ );
+      start_ = std::chrono::steady_clock::now();
+    }
+    ~ProfileScope()
+    {
+      const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start_ );
+      counters_.calls[zone_].fetch_add( 1, std::memory_order_relaxed );
+      counters_.nanoseconds[zone_].fetch_add( static_cast<uint64_t>( elapsed.count() ), std::memory_order_relaxed );
+      host_->newtypeZoneEnd( zone_ );
+    }
+    ProfileScope( const ProfileScope& ) = delete;
+    ProfileScope& operator=( const ProfileScope& ) = delete;
+  };
+
+# define NEWTYPE_PROFILE( manager, zone ) ProfileScope profileScope_( ( manager )->host(), ( manager )->profileCounters(), zone )
+
+// For counters bumped on hot paths from many threads at once, where the shared cache line would cost more than it tells
+# define NEWTYPE_PROFILE_COUNT( counter ) ( counter ).fetch_add( 1, std::memory_order_relaxed )
+
+#else
+
+# define NEWTYPE_PROFILE( manager, zone )
+# define NEWTYPE_PROFILE_COUNT( counter )
+
+#endif
+
+}
\ No newline at end of file
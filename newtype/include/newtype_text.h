@@ -1,39 +1,199 @@
 #pragma once
 #include "newtype.h"
 #include "newtype_utils.h"
+#include "newtype_mesh.h"
+
+#include <unicode/utext.h>
 
 namespace newtype {
 
   class ManagerImpl;
+  class FontFaceImpl;
+  class FontStyleImpl;
+
+  // Compact result of shaping, in pixels and relative to the start of the text
+  struct ShapedGlyph {
+    GlyphIndex index;
+    uint32_t cluster;
+    uint32_t run; // index into TextImpl::shapingRuns_
+    vec2 offset;
+    vec2 advance;
+    bool newline;
+    bool breakBefore; // line break opportunity before this glyph, see TextImpl::findBreaks
+    bool whitespace;
+  };
+
+  using ShapedGlyphs = vector<ShapedGlyph>;
+
+  // A laid out line, as a range of glyphs in visual order
+  struct TextLine {
+    uint32_t first;
+    uint32_t count;
+    Real width; // excluding trailing whitespace
+    Real baseline;
+  };
+
+  using TextLines = vector<TextLine>;
+
+  // A run resolved against the current text, in logical order
+  struct ShapingRun {
+    uint32_t start; // in code units
+    uint32_t length;
+    FontFaceImpl* face;
+    FontStyleImpl* style;
+    uint32_t group; // index into TextImpl::groups_
+    vec4 color;
+  };
+
+  using ShapingRuns = vector<ShapingRun>;
+
+  // A glyph the text needs that wasn't in its style's cache yet
+  struct GlyphMiss {
+    FontFaceImpl* face;
+    FontStyleImpl* style;
+    GlyphIndex index;
+  };
+
+  // Result of TextImpl::checkFastPath()
+  struct FastPathCheck {
+    size_t runs = 0; // that the Basic Latin fast path took
+    size_t glyphs = 0;
+    size_t mismatches = 0; // glyphs shaped differently than by HarfBuzz, or only by one of them
+  };
 
   class TextImpl: public Text {
   private:
+    enum Encoding {
+      Encoding_UTF8,
+      Encoding_UTF16
+    };
     ManagerImpl* manager_;
     vec3 pen_ = vec3( 0.0f );
+    vec3 origin_ = vec3( 0.0f ); // pen offset currently baked into the mesh vertices
+    PenMode penMode_ = PenMode_Baked;
+    // As asked for; the mesh keeps describing the layout it was built in until the next rebuild
+    MeshFormat format_ = MeshFormat_Quads;
+    bool sharedIndices_ = false;
     hb_language_t language_;
     hb_script_t script_;
     hb_direction_t direction_;
     bool dirty_ = false;
-    hb_buffer_t* hbbuf_ = nullptr;
+    bool layoutDirty_ = false;
+    bool meshDirty_ = false;
+    bool penDirty_ = false;
+    bool meshStale_ = false; // mesh_ was skipped by writeMesh(), so it can't just be repositioned
+    bool breaksValid_ = false;
+    bool rightToLeft_ = false; // resolved direction of the last shaping
+    Real wrapWidth_ = 0.0f;
+    TextAlignment alignment_ = TextAlignment_Left;
     FontFacePtr face_;
     StyleID style_;
+    vec4 color_ = vec4( 1.0f );
+    vec4 clipRect_ = vec4( 0.0f );
+    bool clipping_ = false;
+    vector<TextRun> runs_;
+    ShapingRuns shapingRuns_;
+    vector<FontStyleImpl*> groups_; // distinct styles of the runs, in order of first use
+    Real ascender_ = 0.0f; // line metrics over all faces in use
+    Real descender_ = 0.0f;
     vector<hb_feature_t> features_;
-    unicodeString text_;
+    uint64_t featuresHash_ = 0;
+    bool defaultFeatures_ = true; // kerning and ligatures on, as HarfBuzz shapes by default
+    Encoding encoding_ = Encoding_UTF16;
+    string utf8_;
+    u16string utf16_;
+    size_t textLength_ = 0; // in code units of the current encoding
+    uint64_t textHash_ = 0;
+    ShapedGlyphs shaped_;
+    vector<vec2> positions_; // laid out glyph origins, relative to the pen
+    TextLines lines_;
+    vector<GlyphMiss> misses_;
+    // Triple buffering: update() builds into the write slot and publishes it through the shared one,
+    // consumeMesh() swaps the shared one for its read slot. Bit 2 of sharedSlot_ marks it fresh.
+    static constexpr uint32_t c_freshSlot = 4;
+    unique_ptr<array<Mesh, 3>> buffers_;
+    uint32_t writeSlot_ = 0;
+    atomic<uint32_t> sharedSlot_ = 1;
+    uint32_t readSlot_ = 2;
+    uint32_t publishedSlot_ = 2; // last slot published, what mesh() shows on the updating thread
+    bool staged_ = false; // shaped and laid out by stageUpdate(), mesh still to be built
+    const TextBatch* batch_ = nullptr; // holding the text, which fixes its format and pen mode
     Mesh mesh_;
     void* userdata_ = nullptr;
     IDType id_;
+  protected:
+    bool textChanged( Encoding encoding, const void* data, size_t length, size_t unitSize );
+    UChar32 codepointAt( uint32_t cluster ) const;
+    bool addShapingRun( size_t start, size_t length, const FontFacePtr& face, StyleID style, const vec4& color );
+    bool shapeBasicLatin( uint32_t runIndex, hb_direction_t direction );
+    void shapeHarfBuzz( uint32_t runIndex, hb_direction_t direction );
+    void shapeRun( uint32_t runIndex, hb_direction_t direction );
+    void shape();
+    void findBreaks();
+    void layout();
+    bool prepare();
+    pair<size_t, size_t> visibleLines() const;
+    void gatherQuads( const vec3& origin, const Texture* texture, GlyphQuads& quads, MeshGroups* groups );
+    void buildMesh();
+    void publish();
+    bool bakesPen() const;
+    vec3 penOffset() const;
+    bool needsRebuild() const;
+    void reposition();
   public:
     TextImpl( ManagerImpl* manager, IDType id, FontFacePtr face, StyleID style, const Text::Features& features );
-    virtual ~TextImpl();
+    using Text::setText;
     void setText( const unicodeString& text ) override;
+    void setText( string_view utf8 ) override;
+    void setText( u16string_view utf16 ) override;
+    void setLanguage( string_view language ) override;
+    void setScript( string_view script ) override;
+    void setDirection( TextDirection direction ) override;
+    void setFeatures( const Features& features ) override;
+    void setRuns( span<const TextRun> runs ) override;
     void update() override;
+    size_t updateInto( span<uint8_t> destination, MeshSink* sink ) override;
     const Mesh& mesh() const override;
+    const Mesh& consumeMesh() override;
+    bool meshBuffering() const override;
+    void meshBuffering( bool enabled ) override;
     vec3 pen() const override;
     void pen( const vec3& pen ) override;
+    PenMode penMode() const override;
+    void penMode( PenMode mode ) override;
+    MeshFormat meshFormat() const override;
+    void meshFormat( MeshFormat format ) override;
+    bool sharedIndices() const override;
+    void sharedIndices( bool shared ) override;
+    Real wrapWidth() const override;
+    void wrapWidth( Real width ) override;
+    TextAlignment alignment() const override;
+    void alignment( TextAlignment alignment ) override;
+    vec4 color() const override;
+    void color( const vec4& color ) override;
+    vec4 clipRect() const override;
+    void clipRect( const vec4& rect ) override;
+    bool clipping() const override;
+    void clipping( bool enabled ) override;
     bool dirty() const override;
     FontFacePtr face() override;
     StyleID styleid() const override;
     void regenerate();
+    // Manager::updateTexts() phases: parallel, serial, parallel
+    void stageUpdate();
+    void loadMissingGlyphs();
+    void finishUpdate();
+    void unstage();
+    // Shapes every run the Basic Latin fast path takes both ways and compares them
+    FastPathCheck checkFastPath();
+    bool resolveRuns();
+    const vector<FontStyleImpl*>& groups() const { return groups_; }
+    inline const TextBatch* batch() const { return batch_; }
+    inline void batch( const TextBatch* batch ) { batch_ = batch; }
+    size_t writeMesh( span<uint8_t> destination, MeshSink* sink, const Texture* texture );
+    // Memory held, for Manager::stats()
+    size_t textBytes() const;
+    size_t meshBytes() const;
     void setUser( void* data ) override;
     void* getUser() override;
     IDType id() const override;
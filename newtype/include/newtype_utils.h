@@ -1,8 +1,22 @@
 #pragma once
 #include "newtype.h"
 
+// Threading is the library's own business, so hosts don't get these through newtype.h
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <functional>
+
 namespace newtype {
 
+  using std::mutex;
+  using std::shared_mutex;
+  using std::lock_guard;
+  using std::unique_lock;
+  using std::shared_lock;
+  using std::atomic;
+  using std::function;
+
 #define FONT_IMPL_CAST(font) ( font ? dynamic_cast<FontImpl*>( font.get() ) : nullptr )
 #define FONTFACE_IMPL_CAST(face) ( face ? dynamic_cast<FontFaceImpl*>( face.get() ) : nullptr )
 #define FONTSTYLE_IMPL_CAST(style) ( style ? dynamic_cast<FontStyleImpl*>( style.get() ) : nullptr )
@@ -23,6 +37,73 @@ namespace newtype {
     return glm::all( glm::epsilonEqual( a, b, vec3( 0.01f ) ) );
   }
 
+  inline uint32_t packColor( const vec4& color )
+  {
+    auto channel = []( Real value ) { return static_cast<uint32_t>( iround( glm::clamp( value, 0.0f, 1.0f ) * 255.0f ) ); };
+    return ( channel( color.x ) | ( channel( color.y ) << 8 ) | ( channel( color.z ) << 16 ) | ( channel( color.w ) << 24 ) );
+  }
+
+  inline void appendQuadIndices( Indices& indices, VertexIndex first )
+  {
+    const VertexIndex quad[6] = { first + 0, first + 1, first + 2, first + 0, first + 2, first + 3 };
+    indices.insert( indices.end(), quad, quad + 6 );
+  }
+
+  inline int16_t quantizePosition( Real value )
+  {
+    return static_cast<int16_t>( glm::clamp( iround( value ), -32768, 32767 ) );
+  }
+
+  inline uint16_t quantizeTexcoord( Real value )
+  {
+    return static_cast<uint16_t>( iround( glm::clamp( value, 0.0f, 1.0f ) * 65535.0f ) );
+  }
+
+  // 64-bit FNV-1a, cheap enough for change detection on every update
+  inline uint64_t hashBytes( const void* data, size_t length )
+  {
+    auto bytes = static_cast<const uint8_t*>( data );
+    uint64_t hash = 14695981039346656037ull;
+    for ( size_t i = 0; i < length; ++i )
+    {
+      hash ^= bytes[i];
+      hash *= 1099511628211ull;
+    }
+    return hash;
+  }
+
+  // Eight bytes at a time, for telling font files apart
+  inline uint64_t hashContent( span<const uint8_t> bytes )
+  {
+    uint64_t hash = ( 14695981039346656037ull ^ bytes.size() );
+    size_t i = 0;
+    for ( ; i + 8 <= bytes.size(); i += 8 )
+    {
+      uint64_t word;
+      memcpy( &word, bytes.data() + i, 8 );
+      hash = ( hash ^ word ) * 0x9E3779B97F4A7C15ull;
+      hash ^= ( hash >> 29 );
+    }
+    for ( ; i < bytes.size(); ++i )
+    {
+      hash ^= bytes[i];
+      hash *= 1099511628211ull;
+    }
+    return hash;
+  }
+
+  // The size and both ends only, so a mapped file isn't read in whole just to be told apart;
+  // equal samples still need a full comparison
+  inline uint64_t hashSample( span<const uint8_t> bytes )
+  {
+    constexpr size_t c_sampleSize = 0x10000;
+    if ( bytes.size() <= ( c_sampleSize * 2 ) )
+      return hashContent( bytes );
+    const auto head = hashContent( bytes.first( c_sampleSize ) );
+    const auto tail = hashContent( bytes.last( c_sampleSize ) );
+    return ( ( head * 0x9E3779B97F4A7C15ull ) ^ tail ^ bytes.size() );
+  }
+
   class Buffer {
   private:
     Host* host_;
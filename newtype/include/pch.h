@@ -1,5 +1,7 @@
 #pragma once
 
+#ifdef _WIN32
+
 #if !defined( _DEBUG )
 # define _CRT_SECURE_NO_WARNINGS
 # define _SCL_SECURE_NO_WARNINGS
@@ -30,14 +32,19 @@
 #include <crtdbg.h>
 #endif
 
-#include <cstdio>
 #include <malloc.h>
 #include <memory.h>
+#include <eh.h>
+#include <intrin.h>
+
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <cwchar>
 #define _USE_MATH_DEFINES
 #include <cmath>
-#include <eh.h>
-#include <intrin.h>
 #include <cassert>
 
 #include "newtype_types.h"
\ No newline at end of file
@@ -0,0 +1,278 @@
+#include "pch.h"
+#include "newtype_batch.h"
+#include "newtype_manager.h"
+#include "newtype_font.h"
+#include "newtype_text.h"
+
+namespace newtype {
+
+  TextBatch::~TextBatch()
+  {
+    //
+  }
+
+  TextBatchImpl::TextBatchImpl( ManagerImpl* manager, MeshFormat format ):
+  manager_( manager ), format_( format )
+  {
+    // Compact vertices are pen-relative, so texts with different pens can't share a stream
+    if ( format_ == MeshFormat_CompactQuads )
+      NEWTYPE_EXCEPT( "Compact quads can't be batched" );
+    elementSize_ = meshElementSize( format_ );
+    perQuad_ = meshElementsPerQuad( format_ );
+  }
+
+  MeshFormat TextBatchImpl::format() const
+  {
+    return format_;
+  }
+
+  size_t TextBatchImpl::findPage( const Texture* texture )
+  {
+    for ( size_t i = 0; i < pages_.size(); ++i )
+      if ( pages_[i].texture == texture )
+        return i;
+    BatchPage page;
+    page.texture = texture;
+    pages_.push_back( move( page ) );
+    return ( pages_.size() - 1 );
+  }
+
+  void TextBatchImpl::add( TextPtr text )
+  {
+    if ( !text )
+      return;
+    for ( const auto& batched : texts_ )
+      if ( batched.text == text )
+        return;
+
+    auto impl = TEXT_IMPL_CAST( text );
+    if ( !impl )
+      NEWTYPE_EXCEPT( "Text implementation cast failed" );
+    if ( impl->batch() )
+      NEWTYPE_EXCEPT( "Text is already in another batch" );
+
+    impl->meshFormat( format_ );
+    impl->sharedIndices( true );
+    impl->penMode( PenMode_Baked );
+    // From here on the text refuses format and pen mode changes that would break the batch's pages
+    impl->batch( this );
+
+    // Pages are picked on the first update, once the text's runs can be resolved
+    BatchText batched;
+    batched.text = move( text );
+    batched.written = false;
+    texts_.push_back( move( batched ) );
+  }
+
+  void TextBatchImpl::remove( TextPtr text )
+  {
+    for ( auto it = texts_.begin(); it != texts_.end(); ++it )
+    {
+      if ( it->text == text )
+      {
+        for ( auto& entry : it->entries )
+          release( entry );
+        static_cast<TextImpl*>( it->text.get() )->batch( nullptr );
+        texts_.erase( it );
+        return;
+      }
+    }
+  }
+
+  void TextBatchImpl::touch( BatchPage& page, size_t first, size_t count )
+  {
+    if ( count == 0 )
+      return;
+    if ( page.dirtyFirst == page.dirtyEnd )
+    {
+      page.dirtyFirst = first;
+      page.dirtyEnd = first + count;
+      return;
+    }
+    page.dirtyFirst = std::min( page.dirtyFirst, first );
+    page.dirtyEnd = std::max( page.dirtyEnd, first + count );
+  }
+
+  void TextBatchImpl::release( BatchEntry& entry )
+  {
+    // Zeroed quads are degenerate, so the gap draws nothing until compacted away
+    auto& page = pages_[entry.page];
+    memset( page.data.data() + entry.first * elementSize_, 0, entry.count * elementSize_ );
+    touch( page, entry.first, entry.count );
+    page.gaps += entry.capacity;
+    entry.capacity = 0;
+    entry.count = 0;
+  }
+
+  void TextBatchImpl::syncEntries( BatchText& batched, TextImpl* impl )
+  {
+    const auto& groups = impl->groups();
+    auto uses = [&groups]( const Texture* texture ) {
+      return std::any_of( groups.begin(), groups.end(), [texture]( FontStyleImpl* style ) { return &style->texture() == texture; } );
+    };
+
+    auto& entries = batched.entries;
+    for ( auto it = entries.begin(); it != entries.end(); )
+    {
+      if ( uses( it->texture ) )
+        ++it;
+      else
+      {
+        release( *it );
+        it = entries.erase( it );
+      }
+    }
+
+    for ( auto style : groups )
+    {
+      const auto texture = &style->texture();
+      if ( std::any_of( entries.begin(), entries.end(), [texture]( const BatchEntry& entry ) { return entry.texture == texture; } ) )
+        continue;
+      BatchEntry entry;
+      entry.texture = texture;
+      entry.page = findPage( texture );
+      entry.first = pages_[entry.page].size;
+      entry.capacity = 0;
+      entry.count = 0;
+      entries.push_back( entry );
+    }
+  }
+
+  void TextBatchImpl::write( BatchEntry& entry, TextImpl* impl )
+  {
+    auto& page = pages_[entry.page];
+
+    required_ = 0;
+    auto destination = span<uint8_t>( page.data.data() + entry.first * elementSize_, entry.capacity * elementSize_ );
+    auto written = impl->writeMesh( destination, this, entry.texture );
+
+    if ( required_ > 0 )
+    {
+      // Outgrown its range; move to the end of the page with some room to grow
+      const auto needed = ( written + required_ );
+      entry.count = std::max( entry.count, written );
+      release( entry );
+      entry.first = page.size;
+      entry.capacity = ( needed + ( needed / ( 2 * perQuad_ ) ) * perQuad_ );
+      page.size += entry.capacity;
+      page.data.resize( page.size * elementSize_, 0 );
+      destination = span<uint8_t>( page.data.data() + entry.first * elementSize_, entry.capacity * elementSize_ );
+      written = impl->writeMesh( destination, nullptr, entry.texture );
+    }
+
+    // Degenerate whatever the text no longer covers
+    if ( written < entry.count )
+      memset( page.data.data() + ( entry.first + written ) * elementSize_, 0, ( entry.count - written ) * elementSize_ );
+
+    touch( page, entry.first, std::max( written, entry.count ) );
+    entry.count = written;
+  }
+
+  void TextBatchImpl::compact( size_t pageIndex )
+  {
+    auto& page = pages_[pageIndex];
+
+    live_.clear();
+    for ( auto& batched : texts_ )
+      for ( auto& entry : batched.entries )
+        if ( entry.page == pageIndex )
+          live_.push_back( &entry );
+    std::sort( live_.begin(), live_.end(), []( const BatchEntry* a, const BatchEntry* b ) { return a->first < b->first; } );
+
+    // Ranges only ever move towards the start, so in-place moves in order are safe
+    size_t next = 0;
+    for ( auto entry : live_ )
+    {
+      if ( entry->first != next )
+        memmove( page.data.data() + next * elementSize_, page.data.data() + entry->first * elementSize_, entry->capacity * elementSize_ );
+      entry->first = next;
+      next += entry->capacity;
+    }
+
+    page.size = next;
+    page.gaps = 0;
+    page.data.resize( page.size * elementSize_ );
+    page.dirtyFirst = 0;
+    page.dirtyEnd = page.size;
+  }
+
+  void TextBatchImpl::update()
+  {
+    // Shaping goes wide first; writing into the pages is serial
+    staging_.clear();
+    for ( const auto& batched : texts_ )
+      if ( !batched.written || batched.text->dirty() )
+        staging_.push_back( batched.text );
+    manager_->stageTexts( staging_ );
+
+    try
+    {
+      for ( auto& batched : texts_ )
+      {
+        if ( batched.written && !batched.text->dirty() )
+          continue;
+        // The runs decide which pages the text needs, so settle that before writing any of them
+        auto impl = TEXT_IMPL_CAST( batched.text );
+        if ( !impl || !impl->resolveRuns() )
+          continue;
+        syncEntries( batched, impl );
+        for ( auto& entry : batched.entries )
+          write( entry, impl );
+        batched.written = true;
+      }
+    }
+    catch ( ... )
+    {
+      manager_->unstageTexts( staging_ );
+      throw;
+    }
+
+    size_t largest = 0;
+    for ( size_t i = 0; i < pages_.size(); ++i )
+    {
+      if ( pages_[i].gaps > ( pages_[i].size / 2 ) )
+        compact( i );
+      largest = std::max( largest, pages_[i].size );
+    }
+
+    if ( format_ != MeshFormat_Instances )
+      manager_->reserveQuadIndices( largest / perQuad_ );
+  }
+
+  size_t TextBatchImpl::pageCount() const
+  {
+    return pages_.size();
+  }
+
+  TextBatch::Page TextBatchImpl::page( size_t index ) const
+  {
+    const auto& page = pages_[index];
+    Page out;
+    out.texture = page.texture;
+    out.data = span<const uint8_t>( page.data.data(), page.size * elementSize_ );
+    out.elements = page.size;
+    out.dirtyFirst = page.dirtyFirst;
+    out.dirtyCount = ( page.dirtyEnd - page.dirtyFirst );
+    return out;
+  }
+
+  void TextBatchImpl::markClean()
+  {
+    for ( auto& page : pages_ )
+      page.dirtyFirst = page.dirtyEnd = 0;
+  }
+
+  span<uint8_t> TextBatchImpl::newtypeMeshSpace( Text& /*text*/, size_t /*written*/, size_t required )
+  {
+    // Don't hand out more room here; write() relocates the text and retries
+    required_ = required;
+    return span<uint8_t>();
+  }
+
+  TextBatchImpl::~TextBatchImpl()
+  {
+    for ( auto& batched : texts_ )
+      static_cast<TextImpl*>( batched.text.get() )->batch( nullptr );
+  }
+
+}
\ No newline at end of file
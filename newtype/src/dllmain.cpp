@@ -26,6 +26,8 @@ extern "C" {
 
 }
 
+#ifdef _WIN32
+
 BOOL APIENTRY DllMain( HMODULE module, DWORD reason, LPVOID reserved )
 {
   switch ( reason )
@@ -39,4 +41,6 @@ BOOL APIENTRY DllMain( HMODULE module, DWORD reason, LPVOID reserved )
       break;
   }
   return TRUE;
-}
\ No newline at end of file
+}
+
+#endif
\ No newline at end of file
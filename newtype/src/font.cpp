@@ -25,7 +25,7 @@ namespace newtype {
     return static_cast<uint32_t>( size * 1000.0f );
   }
 
-  __forceinline StyleID makeStyleID( FaceID face, uint32_t size, FontRendering rendering, Real thickness )
+  inline StyleID makeStyleID( FaceID face, uint32_t size, FontRendering rendering, Real thickness )
   {
     FontStyleIndex d;
     d.components.face = ( face & 0xFFFF ); // no instance/variations support
@@ -35,17 +35,72 @@ namespace newtype {
     return d.value;
   }
 
-  __forceinline StyleID makeStyleID( FaceID face, Real size, FontRendering rendering, Real thickness )
+  inline StyleID makeStyleID( FaceID face, Real size, FontRendering rendering, Real thickness )
   {
     return makeStyleID( face, makeStoredFaceSize( size ), rendering, thickness );
   }
 
   // FONT FACE ===============================================================
 
-  FontFaceImpl::FontFaceImpl( FontImpl* font, FT_Library ft, FT_Open_Args* args, FaceID faceIndex, Real size ):
-  font_( font ), size_( size )
+  FontFaceImpl::FontFaceImpl( FontImpl* font, FontDataPtr data, FaceID faceIndex, Real size ):
+  manager_( font->manager_ ), font_( font ), data_( move( data ) ), faceIndex_( faceIndex ), size_( size )
   {
-    auto fterr = FT_Open_Face( ft, args, faceIndex, &face_ );
+    // Loading only checks the data is a font holding this face; parsing waits until it's first shaped or measured
+    probe();
+  }
+
+  void FontFaceImpl::probe()
+  {
+    lock_guard<mutex> lock( manager_->rasterizeLock_ );
+
+    auto bytes = data_->bytes();
+
+    FT_Open_Args args = {};
+    args.flags = FT_OPEN_MEMORY;
+    args.memory_base = bytes.data();
+    args.memory_size = (FT_Long)bytes.size();
+
+    // A negative index only reads the header and counts the faces
+    FT_Face probed = nullptr;
+    auto fterr = FT_Open_Face( manager_->ft(), &args, -1, &probed );
+    if ( fterr || !probed )
+      NEWTYPE_FREETYPE_EXCEPT( "FreeType font face load failed", fterr );
+
+    const auto faces = probed->num_faces;
+    FT_Done_Face( probed );
+    // The high bits pick a named instance of a variable font
+    if ( faceIndex_ < 0 || ( faceIndex_ & 0xFFFF ) >= faces )
+      NEWTYPE_EXCEPT( "Font face index out of range" );
+  }
+
+  void FontFaceImpl::open() const
+  {
+    // Throwing leaves the flag unset, so a failed open is retried next time
+    std::call_once( opened_, [this] { const_cast<FontFaceImpl*>( this )->openFace(); } );
+  }
+
+  void FontFaceImpl::openFace()
+  {
+    // FreeType wants face creation serialized against everything else using the library
+    lock_guard<mutex> lock( manager_->rasterizeLock_ );
+    NEWTYPE_PROFILE( manager_, ProfileZone_OpenFace );
+
+    // An earlier attempt may have got this far before failing
+    if ( face_ )
+    {
+      FT_Done_Face( face_ );
+      face_ = nullptr;
+    }
+
+    auto ft = manager_->ft();
+    auto bytes = data_->bytes();
+
+    FT_Open_Args args = {};
+    args.flags = FT_OPEN_MEMORY;
+    args.memory_base = bytes.data();
+    args.memory_size = (FT_Long)bytes.size();
+
+    auto fterr = FT_Open_Face( ft, &args, faceIndex_, &face_ );
     if ( fterr || !face_ )
       NEWTYPE_FREETYPE_EXCEPT( "FreeType font face load failed", fterr );
 
@@ -75,16 +130,18 @@ namespace newtype {
 
   StyleID FontFaceImpl::loadStyle( FontRendering rendering, Real thickness )
   {
-    auto id = makeStyleID( face_->face_index, size_, rendering, thickness );
+    auto id = makeStyleID( faceIndex_, size_, rendering, thickness );
     if ( styles_.find( id ) != styles_.end() )
       return id;
+    if ( !font_ )
+      NEWTYPE_EXCEPT( "Font face belongs to no loaded font" );
 
     auto atlasSize = vec2i( 1024 );
 
     auto style = make_shared<FontStyleImpl>( font_,
-      face_->face_index,
+      faceIndex_,
       makeStoredFaceSize( size_ ),
-      atlasSize, font_->manager_->host(),
+      atlasSize, manager_->host(),
       rendering, thickness );
 
     auto cmp = style->id();
@@ -115,21 +172,191 @@ namespace newtype {
     auto metrics = face_->size->metrics;
     ascender_ = static_cast<Real>( metrics.ascender >> 6 );
     descender_ = static_cast<Real>( metrics.descender >> 6 );
-    size_ = static_cast<Real>( metrics.height >> 6 );
+    height_ = static_cast<Real>( metrics.height >> 6 );
+  }
+
+  hb_shape_plan_t* FontFaceImpl::shapePlan( const hb_segment_properties_t& props, const vector<hb_feature_t>& features, uint64_t featuresHash )
+  {
+    ShapePlanKey key = { props.direction, props.script, props.language, featuresHash };
+
+    lock_guard<mutex> lock( shapePlanLock_ );
+
+    auto it = shapePlans_.find( key );
+    if ( it != shapePlans_.end() )
+    {
+      ++shapePlanHits_;
+      return it->second;
+    }
+    ++shapePlanMisses_;
+
+    unsigned int coordCount = 0;
+    auto coords = hb_font_get_var_coords_normalized( hbfnt_, &coordCount );
+
+    auto plan = hb_shape_plan_create_cached2( hb_font_get_face( hbfnt_ ), &props,
+      features.empty() ? nullptr : features.data(), static_cast<unsigned int>( features.size() ),
+      coords, coordCount, nullptr );
+    if ( !plan )
+      NEWTYPE_EXCEPT( "HarfBuzz shape plan creation failed" );
+
+    shapePlans_[key] = plan;
+    return plan;
+  }
+
+  // Lookup types of the GPOS LookupList by index, looking through extension lookups; 0 where unreadable
+  static vector<uint16_t> gposLookupTypes( hb_face_t* face )
+  {
+    vector<uint16_t> types;
+    auto blob = hb_face_reference_table( face, HB_OT_TAG_GPOS );
+    unsigned int length = 0;
+    auto data = reinterpret_cast<const uint8_t*>( hb_blob_get_data( blob, &length ) );
+    auto read16 = [data, length]( size_t at ) -> uint16_t {
+      return ( ( at + 2 ) <= length ? static_cast<uint16_t>( ( data[at] << 8 ) | data[at + 1] ) : 0 );
+    };
+
+    const size_t list = read16( 8 );
+    if ( list )
+    {
+      types.resize( read16( list ) );
+      for ( size_t i = 0; i < types.size(); ++i )
+      {
+        const size_t lookup = ( list + read16( list + 2 + i * 2 ) );
+        auto type = read16( lookup );
+        if ( type == 9 && read16( lookup + 4 ) )
+          type = read16( lookup + read16( lookup + 6 ) + 2 );
+        types[i] = type;
+      }
+    }
+
+    hb_blob_destroy( blob );
+    return types;
+  }
+
+  void FontFaceImpl::buildBasicLatinTable()
+  {
+    auto table = make_unique<BasicLatinTable>();
+    auto hbface = hb_font_get_face( hbfnt_ );
+
+    // Everything any default-on substitution feature could touch, across all scripts and languages
+    hb_set_t* affected = hb_set_create();
+    {
+      const hb_tag_t defaultFeatures[] = {
+        HB_TAG( 'c', 'c', 'm', 'p' ), HB_TAG( 'l', 'o', 'c', 'l' ), HB_TAG( 'r', 'v', 'r', 'n' ),
+        HB_TAG( 'r', 'l', 'i', 'g' ), HB_TAG( 'r', 'c', 'l', 't' ), HB_TAG( 'c', 'a', 'l', 't' ),
+        HB_TAG( 'l', 'i', 'g', 'a' ), HB_TAG( 'c', 'l', 'i', 'g' ), HB_TAG( 'l', 't', 'r', 'a' ),
+        HB_TAG( 'l', 't', 'r', 'm' ), HB_TAG_NONE };
+      hb_set_t* lookups = hb_set_create();
+      hb_ot_layout_collect_lookups( hbface, HB_OT_TAG_GSUB, nullptr, nullptr, defaultFeatures, lookups );
+      hb_codepoint_t lookup = HB_SET_VALUE_INVALID;
+      while ( hb_set_next( lookups, &lookup ) )
+        hb_ot_layout_lookup_collect_glyphs( hbface, HB_OT_TAG_GSUB, lookup, nullptr, affected, nullptr, nullptr );
+      hb_set_destroy( lookups );
+    }
+
+    // Likewise for default-on positioning, except pair adjustment, which basicLatinKern() shapes pair by pair.
+    // Mark attachment only ever moves marks, so it rules out glyphs GDEF classes as marks instead.
+    {
+      const hb_tag_t defaultFeatures[] = {
+        HB_TAG( 'a', 'b', 'v', 'm' ), HB_TAG( 'b', 'l', 'w', 'm' ), HB_TAG( 'c', 'u', 'r', 's' ),
+        HB_TAG( 'd', 'i', 's', 't' ), HB_TAG( 'k', 'e', 'r', 'n' ), HB_TAG( 'm', 'a', 'r', 'k' ),
+        HB_TAG( 'm', 'k', 'm', 'k' ), HB_TAG_NONE };
+      const auto types = gposLookupTypes( hbface );
+      hb_set_t* lookups = hb_set_create();
+      hb_ot_layout_collect_lookups( hbface, HB_OT_TAG_GPOS, nullptr, nullptr, defaultFeatures, lookups );
+      hb_codepoint_t lookup = HB_SET_VALUE_INVALID;
+      while ( hb_set_next( lookups, &lookup ) )
+      {
+        const auto type = ( lookup < types.size() ? types[lookup] : 0 );
+        if ( type != 2 && ( type < 4 || type > 6 ) )
+          hb_ot_layout_lookup_collect_glyphs( hbface, HB_OT_TAG_GPOS, lookup, affected, affected, affected, nullptr );
+      }
+      hb_set_destroy( lookups );
+    }
+
+    // AAT layout takes over from OpenType altogether and its kerning needn't be pairwise, so such faces always shape
+    const bool aat = ( hb_aat_layout_has_substitution( hbface ) || hb_aat_layout_has_positioning( hbface ) );
+
+    for ( Codepoint cp = 0; cp < BasicLatinTable::c_count; ++cp )
+    {
+      hb_codepoint_t glyph = 0;
+      const bool linebreak = ( cp == '\n' || cp == '\r' );
+      const bool nominal = hb_font_get_nominal_glyph( hbfnt_, cp, &glyph );
+      const bool mark = ( nominal && hb_ot_layout_get_glyph_class( hbface, glyph ) == HB_OT_LAYOUT_GLYPH_CLASS_MARK );
+      table->simple[cp] = ( !aat && ( nominal || linebreak ) && ( cp >= 0x20 || linebreak ) && cp != 0x7F && !mark && !hb_set_has( affected, glyph ) );
+      table->glyphs[cp] = glyph;
+      table->advances[cp] = hb_font_get_glyph_h_advance( hbfnt_, glyph );
+    }
+
+    hb_set_destroy( affected );
+
+    // Pairs are only shaped once a text needs them, see basicLatinKern()
+    for ( Codepoint first = 0; first < BasicLatinTable::c_count; ++first )
+      for ( Codepoint second = 0; second < BasicLatinTable::c_count; ++second )
+        table->kerning[first * BasicLatinTable::c_count + second].store(
+          ( table->simple[first] && table->simple[second] ) ? BasicLatinTable::c_unknownPair : BasicLatinTable::c_complexPair,
+          std::memory_order_relaxed );
+
+    basicLatin_ = move( table );
+  }
+
+  const BasicLatinTable& FontFaceImpl::basicLatin()
+  {
+    std::call_once( basicLatinBuilt_, [this] { buildBasicLatinTable(); } );
+    return *basicLatin_;
+  }
+
+  int16_t FontFaceImpl::basicLatinKern( Codepoint first, Codepoint second )
+  {
+    auto& kern = basicLatin_->kerning[first * BasicLatinTable::c_count + second];
+    auto adjustment = kern.load( std::memory_order_relaxed );
+    if ( adjustment != BasicLatinTable::c_unknownPair )
+      return adjustment;
+
+    // Positioning can't be read out of GPOS directly, so shape the pair on its own the first time it comes up.
+    // Threads racing on the same pair come to the same answer.
+    const auto& table = *basicLatin_;
+    adjustment = BasicLatinTable::c_complexPair;
+    {
+      ShapingBuffer buffer( manager_ );
+      auto hbbuf = buffer.get();
+      const char pair[2] = { static_cast<char>( first ), static_cast<char>( second ) };
+      hb_buffer_set_direction( hbbuf, HB_DIRECTION_LTR );
+      hb_buffer_set_script( hbbuf, HB_SCRIPT_LATIN );
+      hb_buffer_set_language( hbbuf, defaultLanguage() );
+      hb_buffer_add_utf8( hbbuf, pair, 2, 0, 2 );
+      hb_shape( hbfnt_, hbbuf, nullptr, 0 );
+
+      unsigned int count = 0;
+      auto info = hb_buffer_get_glyph_infos( hbbuf, &count );
+      auto gpos = hb_buffer_get_glyph_positions( hbbuf, &count );
+      if ( count == 2 && info[0].codepoint == table.glyphs[first] && info[1].codepoint == table.glyphs[second]
+        && !gpos[0].x_offset && !gpos[0].y_offset && !gpos[1].x_offset && !gpos[1].y_offset
+        && gpos[1].x_advance == table.advances[second] )
+      {
+        const auto shift = ( gpos[0].x_advance - table.advances[first] );
+        if ( shift > BasicLatinTable::c_unknownPair && shift <= numeric_limits<int16_t>::max() )
+          adjustment = static_cast<int16_t>( shift );
+      }
+    }
+
+    kern.store( adjustment, std::memory_order_relaxed );
+    return adjustment;
   }
 
   Real FontFaceImpl::size() const
   {
-    return size_;
+    open();
+    return height_;
   }
 
   Real FontFaceImpl::ascender() const
   {
+    open();
     return ascender_;
   }
 
   Real FontFaceImpl::descender() const
   {
+    open();
     return descender_;
   }
 
@@ -141,9 +368,41 @@ namespace newtype {
     return it->second;
   }
 
+  void FontFaceImpl::collectStats( FaceStats& stats ) const
+  {
+    stats.index = faceIndex_;
+    stats.size = size_;
+    stats.opened = ( hbfnt_ != nullptr );
+    stats.source = data_->source();
+    stats.dataBytes = data_->bytes().size();
+    {
+      lock_guard<mutex> lock( shapePlanLock_ );
+      stats.shapePlans = shapePlans_.size();
+      stats.shapePlanHits = shapePlanHits_;
+      stats.shapePlanMisses = shapePlanMisses_;
+    }
+    stats.styles.clear();
+    for ( const auto& style : styles_ )
+    {
+      StyleStats styleStats;
+      static_cast<const FontStyleImpl*>( style.second.get() )->collectStats( styleStats );
+      stats.styles.push_back( styleStats );
+    }
+  }
+
+  void FontFaceImpl::detach()
+  {
+    for ( auto& style : styles_ )
+      static_cast<FontStyleImpl*>( style.second.get() )->detach();
+    font_ = nullptr;
+  }
+
   FontFaceImpl::~FontFaceImpl()
   {
     styles_.clear();
+    for ( auto& plan : shapePlans_ )
+      hb_shape_plan_destroy( plan.second );
+    shapePlans_.clear();
     if ( hbfnt_ )
       hb_font_destroy( hbfnt_ );
   }
@@ -152,12 +411,18 @@ namespace newtype {
 
   FontStyleImpl::FontStyleImpl( FontImpl* font, FT_Long face, uint32_t size, vec2i atlasSize,
   Host* host, FontRendering rendering, Real thickness ):
-  font_( font ), host_( host ), storedFaceSize_( size ), storedFaceIndex_( face ),
-  rendering_( rendering ), outlineThickness_( thickness )
+  manager_( font->manager_ ), font_( font ), host_( host ), storedFaceSize_( size ), storedFaceIndex_( face ),
+  rendering_( rendering ), outlineThickness_( thickness ), atlasSize_( atlasSize )
   {
-    atlas_ = make_shared<TextureAtlas>( atlasSize, 1 );
-    host_->newtypeFontTextureCreated( *font_, id(), *atlas_.get() );
+    // The atlas waits for the first glyph, plenty of styles are loaded and never drawn
+  }
+
+  void FontStyleImpl::allocateAtlas()
+  {
+    // Called with the rasterize lock and the glyph lock held; texture() tells the host once they're released
+    atlas_ = make_shared<TextureAtlas>( atlasSize_, 1 );
     initEmptyGlyph();
+    atlasReady_.store( true, std::memory_order_release );
   }
 
   void FontStyleImpl::initEmptyGlyph()
@@ -166,15 +431,12 @@ namespace newtype {
     if ( region.x < 0 )
       NEWTYPE_EXCEPT( "Font face texture atlas is full" );
 
-#pragma warning( push )
-#pragma warning( disable: 4838 )
-    static unsigned char data[4 * 4 * 3] = {
-      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+    static const unsigned char data[4 * 4 * 3] = {
+      0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+      0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+      0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+      0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
     };
-#pragma warning( pop )
 
     atlas_->setRegion( (int)region.x, (int)region.y, 4, 4, data, 0 );
 
@@ -202,15 +464,20 @@ namespace newtype {
       FT_Library_SetLcdFilterWeights( ft, weights );
     }
 
-    auto fterr = FT_Load_Glyph( face, index, flags );
-    if ( fterr )
-      NEWTYPE_FREETYPE_EXCEPT( "FreeType glyph load error", fterr );
+    FT_Error fterr;
+    {
+      NEWTYPE_PROFILE( manager_, ProfileZone_LoadGlyph );
+      fterr = FT_Load_Glyph( face, index, flags );
+      if ( fterr )
+        NEWTYPE_FREETYPE_EXCEPT( "FreeType glyph load error", fterr );
+    }
 
     FT_Bitmap bitmap;
     vec2i glyphCoords;
 
     if ( rendering_ == FontRender_Normal )
     {
+      NEWTYPE_PROFILE( manager_, ProfileZone_RenderGlyph );
       FT_GlyphSlot slot = face->glyph;
       fterr = FT_Render_Glyph( slot, FT_RENDER_MODE_NORMAL );
       if ( fterr )
@@ -221,6 +488,7 @@ namespace newtype {
     }
     else if ( rendering_ == FontRender_Outline_Expand )
     {
+      NEWTYPE_PROFILE( manager_, ProfileZone_RenderGlyph );
       FT_Stroker stroker;
       FT_Stroker_New( ft, &stroker );
       auto dist = static_cast<signed long>( outlineThickness_ * c_fmagic );
@@ -238,6 +506,8 @@ namespace newtype {
     else
       NEWTYPE_EXCEPT( "Unknown rendering mode" );
 
+    NEWTYPE_PROFILE( manager_, ProfileZone_PackGlyph );
+
     vec4i padding( 0, 0, 0, 0 );
 
     auto src_w = static_cast<uint32_t>( bitmap.width / atlas_->depth() );
@@ -251,8 +521,11 @@ namespace newtype {
 
     auto coord = vec2i( region.x, region.y );
     {
-      Buffer tmp( host_, static_cast<uint32_t>( tgt_w * tgt_h * atlas_->depth() ) );
-      auto dst_ptr = tmp.data() + ( padding.y * tgt_w + padding.x ) * atlas_->depth();
+      // Called under the manager's rasterize lock, which also guards its scratch arena
+      auto& scratch = manager_->rasterScratch_;
+      ScratchScope rewind( scratch );
+      auto tmp = scratch.allocate( static_cast<size_t>( tgt_w ) * tgt_h * atlas_->depth() );
+      auto dst_ptr = tmp + ( padding.y * tgt_w + padding.x ) * atlas_->depth();
       auto src_ptr = bitmap.buffer;
       for ( uint32_t i = 0; i < src_h; ++i )
       {
@@ -261,7 +534,7 @@ namespace newtype {
         src_ptr += bitmap.pitch;
       }
 
-      atlas_->setRegion( (int)coord.x, (int)coord.y, (int)tgt_w, (int)tgt_h, tmp.data(), (int)tgt_w * atlas_->depth() );
+      atlas_->setRegion( (int)coord.x, (int)coord.y, (int)tgt_w, (int)tgt_h, tmp, (int)tgt_w * atlas_->depth() );
     }
 
     Glyph glyph;
@@ -277,13 +550,38 @@ namespace newtype {
     dirty_ = true;
   }
 
+  bool FontStyleImpl::hasGlyph( GlyphIndex index ) const
+  {
+    shared_lock<shared_mutex> lock( glyphLock_ );
+    return ( glyphs_.find( index ) != glyphs_.end() );
+  }
+
   Glyph* FontStyleImpl::getGlyph( FT_Library ft, FT_Face face, GlyphIndex index )
   {
+    // Map nodes don't move, so a found glyph stays valid after the lock is gone
     {
+      shared_lock<shared_mutex> lock( glyphLock_ );
       const auto& glyph = glyphs_.find( index );
       if ( glyph != glyphs_.end() )
+      {
+        NEWTYPE_PROFILE_COUNT( glyphHits_ );
         return &( ( *glyph ).second );
+      }
     }
+    // The atlas is made and announced first, without holding on to the locks
+    texture();
+    // FreeType faces and the library aren't thread-safe, so rasterizing goes one glyph at a time
+    lock_guard<mutex> rasterizing( manager_->rasterizeLock_ );
+    lock_guard<shared_mutex> lock( glyphLock_ );
+    {
+      const auto& glyph = glyphs_.find( index );
+      if ( glyph != glyphs_.end() )
+      {
+        NEWTYPE_PROFILE_COUNT( glyphHits_ );
+        return &( ( *glyph ).second );
+      }
+    }
+    ++glyphMisses_;
     loadGlyph( ft, face, index, true );
     {
       const auto& glyph = glyphs_.find( index );
@@ -305,13 +603,55 @@ namespace newtype {
 
   const Texture& FontStyleImpl::texture() const
   {
-    assert( atlas_ );
+    if ( !atlasReady_.load( std::memory_order_acquire ) )
+    {
+      auto me = const_cast<FontStyleImpl*>( this );
+      bool created = false;
+      {
+        lock_guard<mutex> rasterizing( manager_->rasterizeLock_ );
+        lock_guard<shared_mutex> lock( glyphLock_ );
+        if ( !atlas_ )
+        {
+          me->allocateAtlas();
+          created = true;
+        }
+      }
+      // Only once the locks are gone, so the host may call straight back in
+      if ( created && font_ )
+        host_->newtypeFontTextureCreated( *font_, id(), *atlas_.get() );
+    }
     return *atlas_.get();
   }
 
+  void FontStyleImpl::collectStats( StyleStats& stats ) const
+  {
+    shared_lock<shared_mutex> lock( glyphLock_ );
+    stats.id = id();
+    stats.atlasAllocated = ( atlas_ != nullptr );
+    stats.atlasSize = atlasSize_;
+    stats.atlasBytes = ( atlas_ ? static_cast<size_t>( atlas_->bytesize() ) : 0 );
+    stats.atlasOccupancy = ( atlas_ ? static_cast<Real>( atlas_->used() ) / static_cast<Real>( atlasSize_.x * atlasSize_.y ) : 0.0f );
+    stats.atlasFragmentation = ( atlas_ ? atlas_->fragmentation() : 0.0f );
+    stats.atlasSkylineNodes = ( atlas_ ? atlas_->skylineNodes() : 0 );
+    stats.glyphs = glyphs_.size();
+    // A map node is the pair plus three links and a color
+    stats.glyphBytes = glyphs_.size() * ( sizeof( GlyphMap::value_type ) + 4 * sizeof( void* ) );
+    stats.glyphHits = glyphHits_.load( std::memory_order_relaxed );
+    stats.glyphMisses = glyphMisses_;
+  }
+
+  void FontStyleImpl::detach()
+  {
+    // Nothing draws with the texture once no font is loaded, so the host hears the last of it now
+    if ( atlas_ && font_ )
+      host_->newtypeFontTextureDestroyed( *font_, id(), *atlas_.get() );
+    font_ = nullptr;
+  }
+
   FontStyleImpl::~FontStyleImpl()
   {
-    host_->newtypeFontTextureDestroyed( *font_, id(), *atlas_.get() );
+    if ( atlas_ && font_ )
+      host_->newtypeFontTextureDestroyed( *font_, id(), *atlas_.get() );
     atlas_.reset();
   }
 
@@ -322,24 +662,18 @@ namespace newtype {
 
   // FONT ====================================================================
 
-  FontFacePtr FontImpl::loadFace( span<uint8_t> source, FaceID faceIndex, Real size )
+  FontFacePtr FontImpl::loadFace( FontDataPtr data, FaceID faceIndex, Real size )
   {
-    // Make a safety copy in our own memory
-    // Loading new styles on the fly later could still access this memory
-    // and we won't rely on the host keeping that available and alive
-    // Of course, if multiple faces are actually loaded from different blobs
-    // despite belonging to the same font, this copy will only contain the
-    // last loaded one - but that's pretty suspect behavior anyway, don't do it
-    data_ = make_unique<Buffer>( manager_->host(), source );
-
-    auto ftlib = manager_->ft();
-
-    FT_Open_Args args = { 0 };
-    args.flags = FT_OPEN_MEMORY;
-    args.memory_base = data_->data();
-    args.memory_size = (FT_Long)data_->length();
-
-    auto face = make_shared<FontFaceImpl>( this, ftlib, &args, faceIndex, size );
+    // Each face holds on to the data it was opened from, since loading new styles
+    // on the fly later still reads it. Faces of one font may come from different data.
+    // Other fonts that loaded the same data get the same face, styles and glyph caches.
+    auto face = manager_->findFace( data.get(), faceIndex, size );
+    if ( !face )
+    {
+      auto key = data.get();
+      face = make_shared<FontFaceImpl>( this, move( data ), faceIndex, size );
+      manager_->shareFace( key, faceIndex, size, face );
+    }
     faces_[faceIndex] = face;
 
     loaded_ = true;
@@ -349,7 +683,9 @@ namespace newtype {
 
   void FontImpl::unload()
   {
-    data_.reset();
+    // Data goes away with the last face, which texts or other fonts may still be holding on to
+    manager_->handOverFaces( this );
+    faces_.clear();
     loaded_ = false;
   }
 
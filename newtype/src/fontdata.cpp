@@ -0,0 +1,110 @@
+#include "pch.h"
+#include "newtype_fontdata.h"
+
+#ifndef _WIN32
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+namespace newtype {
+
+  span<const uint8_t> CopiedFontData::bytes() const
+  {
+    return { const_cast<Buffer&>( buffer_ ).data(), buffer_.length() };
+  }
+
+  span<const uint8_t> BlobFontData::bytes() const
+  {
+    return blob_.data;
+  }
+
+  BlobFontData::~BlobFontData()
+  {
+    if ( blob_.release )
+      blob_.release( blob_.context, blob_.data.data(), blob_.data.size() );
+  }
+
+#ifdef _WIN32
+
+  MappedFontData::MappedFontData( const string& path )
+  {
+    auto length = MultiByteToWideChar( CP_UTF8, 0, path.c_str(), -1, nullptr, 0 );
+    if ( length <= 0 )
+      NEWTYPE_EXCEPT( "Font file path conversion failed" );
+    wstring widePath( static_cast<size_t>( length ), L'\0' );
+    MultiByteToWideChar( CP_UTF8, 0, path.c_str(), -1, widePath.data(), length );
+
+    auto file = CreateFileW( widePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+    if ( file == INVALID_HANDLE_VALUE )
+      NEWTYPE_EXCEPT( "Font file open failed" );
+
+    LARGE_INTEGER fileSize = {};
+    FILETIME written = {};
+    if ( !GetFileSizeEx( file, &fileSize ) || fileSize.QuadPart <= 0 || !GetFileTime( file, nullptr, nullptr, &written ) )
+    {
+      CloseHandle( file );
+      NEWTYPE_EXCEPT( "Font file is empty or unreadable" );
+    }
+
+    // The view keeps the file and the mapping alive on its own
+    auto mapping = CreateFileMappingW( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+    CloseHandle( file );
+    if ( !mapping )
+      NEWTYPE_EXCEPT( "Font file mapping failed" );
+
+    view_ = static_cast<const uint8_t*>( MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) );
+    CloseHandle( mapping );
+    if ( !view_ )
+      NEWTYPE_EXCEPT( "Font file view mapping failed" );
+
+    size_ = static_cast<size_t>( fileSize.QuadPart );
+    identity_ = path + "|" + std::to_string( size_ ) + "|" + std::to_string( ( static_cast<uint64_t>( written.dwHighDateTime ) << 32 ) | written.dwLowDateTime );
+  }
+
+  MappedFontData::~MappedFontData()
+  {
+    if ( view_ )
+      UnmapViewOfFile( view_ );
+  }
+
+#else
+
+  MappedFontData::MappedFontData( const string& path )
+  {
+    auto file = ::open( path.c_str(), O_RDONLY );
+    if ( file < 0 )
+      NEWTYPE_EXCEPT( "Font file open failed" );
+
+    struct stat info = {};
+    if ( ::fstat( file, &info ) != 0 || info.st_size <= 0 )
+    {
+      ::close( file );
+      NEWTYPE_EXCEPT( "Font file is empty or unreadable" );
+    }
+
+    auto view = ::mmap( nullptr, static_cast<size_t>( info.st_size ), PROT_READ, MAP_PRIVATE, file, 0 );
+    ::close( file );
+    if ( view == MAP_FAILED )
+      NEWTYPE_EXCEPT( "Font file mapping failed" );
+
+    view_ = static_cast<const uint8_t*>( view );
+    size_ = static_cast<size_t>( info.st_size );
+    identity_ = path + "|" + std::to_string( size_ ) + "|" + std::to_string( static_cast<int64_t>( info.st_mtime ) );
+  }
+
+  MappedFontData::~MappedFontData()
+  {
+    if ( view_ )
+      ::munmap( const_cast<uint8_t*>( view_ ), size_ );
+  }
+
+#endif
+
+  span<const uint8_t> MappedFontData::bytes() const
+  {
+    return { view_, size_ };
+  }
+
+}
\ No newline at end of file
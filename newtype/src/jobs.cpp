@@ -0,0 +1,142 @@
+#include "pch.h"
+#include "newtype_jobs.h"
+
+namespace newtype {
+
+  JobPool::JobPool( JobHost* host, size_t workers ): host_( host )
+  {
+    if ( host_ )
+      return;
+    workers_.reserve( workers );
+    for ( size_t i = 0; i < workers; ++i )
+      workers_.emplace_back( [this] { workerMain(); } );
+  }
+
+  size_t JobPool::concurrency() const
+  {
+    if ( host_ )
+      return static_cast<size_t>( host_->newtypeJobWorkerCount() ) + 1;
+    return ( workers_.size() + 1 );
+  }
+
+  void JobPool::drain()
+  {
+    while ( true )
+    {
+      const auto first = next_.fetch_add( grain_ );
+      if ( first >= count_ )
+        return;
+      const auto end = std::min( first + grain_, count_ );
+      try
+      {
+        for ( auto i = first; i < end; ++i )
+          ( *job_ )( i );
+      }
+      catch ( ... )
+      {
+        lock_guard<mutex> lock( lock_ );
+        if ( !error_ )
+          error_ = std::current_exception();
+        next_ = count_;
+      }
+    }
+  }
+
+  void JobPool::workerMain()
+  {
+    uint64_t seen = 0;
+    while ( true )
+    {
+      {
+        unique_lock<mutex> lock( lock_ );
+        wake_.wait( lock, [this, seen] { return ( stopping_ || generation_ != seen ); } );
+        if ( stopping_ )
+          return;
+        seen = generation_;
+      }
+      drain();
+      {
+        lock_guard<mutex> lock( lock_ );
+        if ( --pending_ == 0 )
+          done_.notify_all();
+      }
+    }
+  }
+
+  void NEWTYPE_CALL JobPool::hostJob( void* context )
+  {
+    static_cast<JobPool*>( context )->drain();
+  }
+
+  void JobPool::runOnHost()
+  {
+    // Host jobs only claim work off the shared counter, so it's fine for some to start after it's gone
+    const auto jobs = std::min( concurrency() - 1, ( count_ + grain_ - 1 ) / grain_ - 1 );
+    handles_.clear();
+    for ( size_t i = 0; i < jobs; ++i )
+      handles_.push_back( host_->newtypeJobSubmit( hostJob, this ) );
+
+    drain();
+
+    for ( auto handle : handles_ )
+      host_->newtypeJobWait( handle );
+  }
+
+  void JobPool::parallelFor( size_t count, const function<void( size_t )>& job )
+  {
+    if ( count == 0 )
+      return;
+
+    if ( concurrency() == 1 || count == 1 )
+    {
+      for ( size_t i = 0; i < count; ++i )
+        job( i );
+      return;
+    }
+
+    lock_guard<mutex> run( runLock_ );
+    {
+      lock_guard<mutex> lock( lock_ );
+      job_ = &job;
+      count_ = count;
+      // Several items per claim keeps the shared counter out of the way of small items
+      grain_ = std::max( count / ( concurrency() * 8 ), static_cast<size_t>( 1 ) );
+      next_ = 0;
+      error_ = nullptr;
+      // Every worker checks in, even one waking after the work is gone,
+      // so none can still be looking at this job once the next one is set up
+      pending_ = workers_.size();
+      ++generation_;
+    }
+
+    if ( host_ )
+      runOnHost();
+    else
+    {
+      wake_.notify_all();
+      drain();
+    }
+
+    std::exception_ptr error;
+    {
+      unique_lock<mutex> lock( lock_ );
+      done_.wait( lock, [this] { return ( pending_ == 0 ); } );
+      job_ = nullptr;
+      error = std::exchange( error_, nullptr );
+    }
+    if ( error )
+      std::rethrow_exception( error );
+  }
+
+  JobPool::~JobPool()
+  {
+    {
+      lock_guard<mutex> lock( lock_ );
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for ( auto& worker : workers_ )
+      worker.join();
+  }
+
+}
\ No newline at end of file
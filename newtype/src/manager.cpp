@@ -1,30 +1,33 @@
 #include "pch.h"
 #include "newtype_manager.h"
 #include "newtype_font.h"
+#include "newtype_fontdata.h"
 #include "newtype_text.h"
+#include "newtype_batch.h"
 
 namespace newtype {
 
   void* ftMemoryAllocate( FT_Memory memory, long size )
   {
     auto me = reinterpret_cast<ManagerImpl*>( memory->user );
-    return ( me ? me->host()->newtypeMemoryAllocate( size ) : nullptr );
+    return ( me ? me->freeTypePool().allocate( static_cast<size_t>( size ) ) : nullptr );
   }
 
   void* ftMemoryReallocate( FT_Memory memory, long currentSize, long newSize, void* block )
   {
     auto me = reinterpret_cast<ManagerImpl*>( memory->user );
-    return ( me ? me->host()->newtypeMemoryReallocate( block, newSize ) : nullptr );
+    return ( me ? me->freeTypePool().reallocate( block, static_cast<size_t>( newSize ) ) : nullptr );
   }
 
   void ftMemoryFree( FT_Memory memory, void* block )
   {
     auto me = reinterpret_cast<ManagerImpl*>( memory->user );
     if ( me )
-      me->host()->newtypeMemoryFree( block );
+      me->freeTypePool().free( block );
   }
 
-  ManagerImpl::ManagerImpl( Host* host ): host_( host )
+  ManagerImpl::ManagerImpl( Host* host ):
+    host_( host ), ftPool_( host, memoryCounters_ ), rasterScratch_( host, memoryCounters_ )
   {
     ftMemAllocator_.user = this;
     ftMemAllocator_.alloc = ftMemoryAllocate;
@@ -50,7 +53,7 @@ namespace newtype {
     ftVersion_.trueTypeSupport = FT_Get_TrueType_Engine_Type( freeType_ );
 
     char tmp[128];
-    sprintf_s( tmp, 128, "FreeType v%i.%i.%i HarfBuzz v%i.%i.%i",
+    snprintf( tmp, sizeof( tmp ), "FreeType v%i.%i.%i HarfBuzz v%i.%i.%i",
       ftVersion_.major, ftVersion_.minor, ftVersion_.patch,
       hbVersion_.major, hbVersion_.minor, hbVersion_.patch );
     verstr_ = tmp;
@@ -71,7 +74,129 @@ namespace newtype {
     auto fnt = FONT_IMPL_CAST( font );
     if ( !fnt )
       NEWTYPE_EXCEPT( "Font implementation cast failed" );
-    return fnt->loadFace( buffer, faceIndex, size );
+    // Only copy what we haven't got already
+    auto hash = hashSample( buffer );
+    auto data = findFontData( hash, buffer, {} );
+    if ( !data )
+    {
+      data = make_shared<CopiedFontData>( host_, buffer );
+      sharedData_[hash].push_back( data );
+    }
+    return fnt->loadFace( move( data ), faceIndex, size );
+  }
+
+  FontFacePtr ManagerImpl::loadFace( FontPtr font, const FontBlob& blob, FaceID faceIndex, Real size )
+  {
+    // Owning the blob from here on, so release it even if the cast fails
+    auto data = make_shared<BlobFontData>( blob );
+    auto fnt = FONT_IMPL_CAST( font );
+    if ( !fnt )
+      NEWTYPE_EXCEPT( "Font implementation cast failed" );
+    return fnt->loadFace( shareFontData( move( data ) ), faceIndex, size );
+  }
+
+  FontFacePtr ManagerImpl::loadFaceFromFile( FontPtr font, const string& path, FaceID faceIndex, Real size )
+  {
+    auto fnt = FONT_IMPL_CAST( font );
+    if ( !fnt )
+      NEWTYPE_EXCEPT( "Font implementation cast failed" );
+    return fnt->loadFace( shareFontData( make_shared<MappedFontData>( path ) ), faceIndex, size );
+  }
+
+  shared_ptr<FontData> ManagerImpl::findFontData( uint64_t hash, span<const uint8_t> bytes, const string& identity )
+  {
+    auto it = sharedData_.find( hash );
+    if ( it == sharedData_.end() )
+      return {};
+
+    shared_ptr<FontData> found;
+    auto& candidates = it->second;
+    for ( auto candidate = candidates.begin(); candidate != candidates.end(); )
+    {
+      auto data = candidate->lock();
+      if ( !data )
+      {
+        candidate = candidates.erase( candidate );
+        continue;
+      }
+      // Only a sample went into the hash, so it takes the same file or the same bytes throughout
+      auto other = data->bytes();
+      const bool sameFile = ( !identity.empty() && identity == data->identity() );
+      if ( !found && other.size() == bytes.size() && ( sameFile || other.data() == bytes.data() || memcmp( other.data(), bytes.data(), bytes.size() ) == 0 ) )
+        found = move( data );
+      ++candidate;
+    }
+    if ( candidates.empty() )
+      sharedData_.erase( it );
+    return found;
+  }
+
+  shared_ptr<FontData> ManagerImpl::shareFontData( shared_ptr<FontData> data )
+  {
+    auto hash = hashSample( data->bytes() );
+    if ( auto existing = findFontData( hash, data->bytes(), data->identity() ) )
+      return existing;
+    sharedData_[hash].push_back( data );
+    return data;
+  }
+
+  shared_ptr<FontFaceImpl> ManagerImpl::findFace( const FontData* data, FaceID faceIndex, Real size )
+  {
+    auto it = sharedFaces_.find( { data, faceIndex, size } );
+    if ( it == sharedFaces_.end() )
+      return {};
+    auto face = it->second.lock();
+    if ( !face )
+      sharedFaces_.erase( it );
+    // Faces left behind by unloaded fonts stay with the texts holding them; a new font gets a fresh one
+    if ( face && !face->font_ )
+      return {};
+    return face;
+  }
+
+  void ManagerImpl::shareFace( const FontData* data, FaceID faceIndex, Real size, const shared_ptr<FontFaceImpl>& face )
+  {
+    // Drop faces that have gone away, their data might be at the same address as new data later
+    for ( auto it = sharedFaces_.begin(); it != sharedFaces_.end(); )
+    {
+      if ( it->second.expired() )
+        it = sharedFaces_.erase( it );
+      else
+        ++it;
+    }
+    sharedFaces_[{ data, faceIndex, size }] = face;
+  }
+
+  void ManagerImpl::handOverFaces( FontImpl* font )
+  {
+    for ( auto& entry : font->faces_ )
+    {
+      auto face = static_cast<FontFaceImpl*>( entry.second.get() );
+      if ( face->font_ != font )
+        continue;
+      FontImpl* heir = nullptr;
+      for ( auto& other : fonts_ )
+      {
+        auto candidate = static_cast<FontImpl*>( other.get() );
+        if ( candidate == font || !candidate->loaded_ )
+          continue;
+        auto shared = std::find_if( candidate->faces_.begin(), candidate->faces_.end(),
+          [&entry]( const FontFaceMap::value_type& value ) { return value.second == entry.second; } );
+        if ( shared == candidate->faces_.end() )
+          continue;
+        heir = candidate;
+        break;
+      }
+      // Texts may keep the face alive well past the font, so it can't point back at it
+      if ( !heir )
+      {
+        face->detach();
+        continue;
+      }
+      face->font_ = heir;
+      for ( auto& style : face->styles_ )
+        static_cast<FontStyleImpl*>( style.second.get() )->font_ = heir;
+    }
   }
 
   StyleID ManagerImpl::loadStyle( FontFacePtr face, FontRendering rendering, Real thickness )
@@ -97,12 +222,191 @@ namespace newtype {
     }
   }
 
+  static size_t raiseHighWater( atomic<size_t>& mark, size_t value )
+  {
+    auto current = mark.load( std::memory_order_relaxed );
+    while ( value > current && !mark.compare_exchange_weak( current, value, std::memory_order_relaxed ) )
+    {
+      // current is reloaded by a failed exchange
+    }
+    return std::max( current, value );
+  }
+
+  hb_buffer_t* ManagerImpl::acquireShapingBuffer()
+  {
+    hb_buffer_t* buffer = nullptr;
+    {
+      lock_guard<mutex> lock( shapingBufferLock_ );
+      if ( !shapingBuffers_.empty() )
+      {
+        buffer = shapingBuffers_.back();
+        shapingBuffers_.pop_back();
+      }
+    }
+    if ( !buffer )
+      buffer = hb_buffer_create();
+    // Whichever buffer a run gets, it's already as large as any run shaped before
+    hb_buffer_pre_allocate( buffer, static_cast<unsigned int>( shapingLength_.load( std::memory_order_relaxed ) ) );
+    if ( !hb_buffer_allocation_successful( buffer ) )
+    {
+      hb_buffer_destroy( buffer );
+      NEWTYPE_EXCEPT( "HarfBuzz buffer creation failed" );
+    }
+    return buffer;
+  }
+
+  void ManagerImpl::releaseShapingBuffer( hb_buffer_t* buffer )
+  {
+    raiseHighWater( shapingLength_, hb_buffer_get_length( buffer ) );
+    // Reset keeps the allocated arrays around for the next borrower
+    hb_buffer_reset( buffer );
+    lock_guard<mutex> lock( shapingBufferLock_ );
+    shapingBuffers_.push_back( buffer );
+  }
+
+  IndicesPtr ManagerImpl::reserveQuadIndices( size_t quads )
+  {
+    lock_guard<mutex> lock( quadIndexLock_ );
+    const auto current = ( quadIndices_->size() / 6 );
+    if ( quads <= current )
+      return quadIndices_;
+    // Doubling, so a run of slightly longer texts doesn't rebuild it every time
+    auto grown = std::max( current * 2, static_cast<size_t>( 256 ) );
+    while ( grown < quads )
+      grown *= 2;
+    auto indices = make_shared<Indices>();
+    indices->reserve( grown * 6 );
+    for ( size_t i = 0; i < grown; ++i )
+      appendQuadIndices( *indices, static_cast<VertexIndex>( i * 4 ) );
+    quadIndices_ = move( indices );
+    return quadIndices_;
+  }
+
+  void ManagerImpl::reserveQuadScratch( GlyphQuads& quads, size_t count, size_t colors )
+  {
+    // Any thread may build any text, so every thread's scratch goes up to the largest build anywhere.
+    // Each one then stops allocating after its next build, not only once it has built that text itself.
+    quads.reserve( raiseHighWater( scratchQuads_, count ), raiseHighWater( scratchColors_, colors ) );
+  }
+
+  TextBatchPtr ManagerImpl::createBatch( MeshFormat format )
+  {
+    return make_shared<TextBatchImpl>( this, format );
+  }
+
+  JobPool& ManagerImpl::jobs()
+  {
+    // The host's job system if it has one, otherwise threads of our own
+    if ( !jobs_ )
+    {
+      auto host = host_->newtypeJobHost();
+      jobs_ = make_unique<JobPool>( host, host ? 0 : ( std::max( std::thread::hardware_concurrency(), 1u ) - 1 ) );
+    }
+    return *jobs_;
+  }
+
+  void ManagerImpl::stageTexts( span<const TextPtr> texts )
+  {
+    try
+    {
+      // Shaping and layout in parallel, noting glyphs missing from the caches on the way
+      jobs().parallelFor( texts.size(), [texts]( size_t i ) {
+        if ( auto impl = TEXT_IMPL_CAST( texts[i] ) )
+          impl->stageUpdate();
+      } );
+
+      // Rasterizing and packing the misses is serial anyway, so do it in one go
+      for ( const auto& text : texts )
+        if ( auto impl = TEXT_IMPL_CAST( text ) )
+          impl->loadMissingGlyphs();
+    }
+    catch ( ... )
+    {
+      unstageTexts( texts );
+      throw;
+    }
+  }
+
+  void ManagerImpl::unstageTexts( span<const TextPtr> texts )
+  {
+    for ( const auto& text : texts )
+      if ( auto impl = TEXT_IMPL_CAST( text ) )
+        impl->unstage();
+  }
+
+  void ManagerImpl::updateTexts( span<const TextPtr> texts )
+  {
+    // Checked up front, so nothing's half done when one turns out to be batched
+    for ( const auto& text : texts )
+      if ( auto impl = TEXT_IMPL_CAST( text ) )
+        if ( impl->batch() )
+          NEWTYPE_EXCEPT( "Batched texts are updated by their batch" );
+
+    stageTexts( texts );
+
+    try
+    {
+      // Every glyph is cached by now, so mesh building only reads the caches
+      jobs().parallelFor( texts.size(), [texts]( size_t i ) {
+        if ( auto impl = TEXT_IMPL_CAST( texts[i] ) )
+          impl->finishUpdate();
+      } );
+    }
+    catch ( ... )
+    {
+      unstageTexts( texts );
+      throw;
+    }
+  }
+
+  IndicesPtr ManagerImpl::quadIndices() const
+  {
+    lock_guard<mutex> lock( quadIndexLock_ );
+    return quadIndices_;
+  }
+
+  icu::BreakIterator* ManagerImpl::acquireLineBreaker()
+  {
+    {
+      lock_guard<mutex> lock( lineBreakerLock_ );
+      if ( !lineBreakers_.empty() )
+      {
+        auto breaker = lineBreakers_.back();
+        lineBreakers_.pop_back();
+        return breaker;
+      }
+    }
+    UErrorCode status = U_ZERO_ERROR;
+    auto breaker = icu::BreakIterator::createLineInstance( icu::Locale::getRoot(), status );
+    if ( U_FAILURE( status ) || !breaker )
+    {
+      delete breaker;
+      NEWTYPE_EXCEPT( "ICU line break iterator creation failed" );
+    }
+    return breaker;
+  }
+
+  void ManagerImpl::releaseLineBreaker( icu::BreakIterator* breaker )
+  {
+    lock_guard<mutex> lock( lineBreakerLock_ );
+    lineBreakers_.push_back( breaker );
+  }
+
   TextPtr ManagerImpl::createText( FontFacePtr face, StyleID style )
   {
     Text::Features feats;
     feats.kerning = true;
     feats.ligatures = true;
     auto text = make_shared<TextImpl>( this, textIndex_++, face, style, feats );
+    {
+      lock_guard<mutex> lock( textsLock_ );
+      if ( texts_.size() >= textsPruneAt_ )
+      {
+        texts_.erase( std::remove_if( texts_.begin(), texts_.end(), []( const weak_ptr<Text>& entry ) { return entry.expired(); } ), texts_.end() );
+        textsPruneAt_ = std::max( static_cast<size_t>( 64 ), texts_.size() * 2 );
+      }
+      texts_.push_back( text );
+    }
     return text;
   }
 
@@ -113,6 +417,19 @@ namespace newtype {
 
   void ManagerImpl::shutdown()
   {
+    jobs_.reset();
+    {
+      lock_guard<mutex> lock( shapingBufferLock_ );
+      for ( auto buffer : shapingBuffers_ )
+        hb_buffer_destroy( buffer );
+      shapingBuffers_.clear();
+    }
+    {
+      lock_guard<mutex> lock( lineBreakerLock_ );
+      for ( auto breaker : lineBreakers_ )
+        delete breaker;
+      lineBreakers_.clear();
+    }
     if ( freeType_ )
     {
       FT_Done_Library( freeType_ );
@@ -125,6 +442,102 @@ namespace newtype {
     return verstr_;
   }
 
+  ManagerStats ManagerImpl::stats() const
+  {
+    ManagerStats stats = {};
+
+    // Fonts loaded from the same data share faces, count those and the data only once
+    map<const FontFaceImpl*, size_t> faceUsers;
+    for ( const auto& font : fonts_ )
+      for ( const auto& face : static_cast<const FontImpl*>( font.get() )->faces_ )
+        ++faceUsers[static_cast<const FontFaceImpl*>( face.second.get() )];
+
+    vector<const FontData*> countedData;
+    vector<const FontFaceImpl*> countedFaces;
+    for ( const auto& font : fonts_ )
+    {
+      auto impl = static_cast<const FontImpl*>( font.get() );
+      FontStats fontStats;
+      fontStats.id = impl->id();
+      for ( const auto& entry : impl->faces_ )
+      {
+        auto face = static_cast<const FontFaceImpl*>( entry.second.get() );
+        FaceStats faceStats;
+        face->collectStats( faceStats );
+        faceStats.shared = ( faceUsers[face] > 1 );
+
+        if ( std::find( countedData.begin(), countedData.end(), face->data_.get() ) == countedData.end() )
+        {
+          countedData.push_back( face->data_.get() );
+          stats.fontDataBytes[faceStats.source] += faceStats.dataBytes;
+        }
+        if ( std::find( countedFaces.begin(), countedFaces.end(), face ) == countedFaces.end() )
+        {
+          countedFaces.push_back( face );
+          for ( const auto& style : faceStats.styles )
+          {
+            stats.atlasBytes += style.atlasBytes;
+            stats.glyphs += style.glyphs;
+            stats.glyphBytes += style.glyphBytes;
+          }
+        }
+        fontStats.faces.push_back( move( faceStats ) );
+      }
+      stats.fonts.push_back( move( fontStats ) );
+    }
+
+    {
+      lock_guard<mutex> lock( textsLock_ );
+      for ( const auto& entry : texts_ )
+      {
+        auto text = entry.lock();
+        if ( !text )
+          continue;
+        auto impl = static_cast<const TextImpl*>( text.get() );
+        ++stats.texts;
+        stats.textBytes += impl->textBytes();
+        stats.meshBytes += impl->meshBytes();
+      }
+    }
+
+    stats.quadIndexBytes = ( quadIndices()->capacity() * sizeof( VertexIndex ) );
+    {
+      lock_guard<mutex> lock( shapingBufferLock_ );
+      stats.idleShapingBuffers = shapingBuffers_.size();
+    }
+    {
+      lock_guard<mutex> lock( lineBreakerLock_ );
+      stats.idleLineBreakers = lineBreakers_.size();
+    }
+    stats.memory = memoryStats();
+    return stats;
+  }
+
+  ProfileStats ProfileCounters::collect()
+  {
+    ProfileStats stats = {};
+    for ( size_t i = 0; i < ProfileZone_Count; ++i )
+    {
+      stats.calls[i] = calls[i].exchange( 0, std::memory_order_relaxed );
+      stats.nanoseconds[i] = nanoseconds[i].exchange( 0, std::memory_order_relaxed );
+    }
+    return stats;
+  }
+
+  ProfileStats ManagerImpl::collectProfile()
+  {
+    return profile_.collect();
+  }
+
+  MemoryStats ManagerImpl::memoryStats() const
+  {
+    MemoryStats stats = {};
+    memoryCounters_.addTo( stats );
+    if ( auto harfBuzz = harfBuzzMemoryCounters() )
+      harfBuzz->addTo( stats );
+    return stats;
+  }
+
   ManagerImpl::~ManagerImpl()
   {
     //
@@ -0,0 +1,298 @@
+#include "pch.h"
+#include "newtype_memory.h"
+
+namespace newtype {
+
+  void MemoryCounters::addTo( MemoryStats& stats ) const
+  {
+    stats.hostAllocations += hostAllocations.load( std::memory_order_relaxed );
+    stats.hostFrees += hostFrees.load( std::memory_order_relaxed );
+    stats.poolAllocations += poolAllocations.load( std::memory_order_relaxed );
+    stats.poolFrees += poolFrees.load( std::memory_order_relaxed );
+    stats.largeAllocations += largeAllocations.load( std::memory_order_relaxed );
+    stats.bytesInUse += bytesInUse.load( std::memory_order_relaxed );
+    stats.bytesReserved += bytesReserved.load( std::memory_order_relaxed );
+  }
+
+  // POOL ALLOCATOR ==========================================================
+
+  PoolAllocator::PoolAllocator( Host* host, MemoryCounters& counters ): host_( host ), counters_( counters )
+  {
+  }
+
+  void* PoolAllocator::backingAllocate( size_t size )
+  {
+    void* address = nullptr;
+    if ( host_ )
+      address = ( size <= numeric_limits<uint32_t>::max() ? host_->newtypeMemoryAllocate( static_cast<uint32_t>( size ) ) : nullptr );
+    else
+      address = ::malloc( size );
+    if ( address )
+      counters_.hostAllocations.fetch_add( 1, std::memory_order_relaxed );
+    return address;
+  }
+
+  void PoolAllocator::backingFree( void* address )
+  {
+    counters_.hostFrees.fetch_add( 1, std::memory_order_relaxed );
+    if ( host_ )
+      host_->newtypeMemoryFree( address );
+    else
+      ::free( address );
+  }
+
+  void* PoolAllocator::carve( size_t sizeClass )
+  {
+    const auto size = classSize( sizeClass );
+    if ( remaining_ < size )
+    {
+      // The rest of the old chunk is too small for this class; hand it out to smaller ones first
+      for ( auto smaller = sizeClass; smaller-- > 0 && remaining_ >= classSize( 0 ); )
+      {
+        while ( remaining_ >= classSize( smaller ) )
+        {
+          auto block = reinterpret_cast<FreeBlock*>( cursor_ );
+          block->next = freeLists_[smaller];
+          freeLists_[smaller] = block;
+          cursor_ += classSize( smaller );
+          remaining_ -= classSize( smaller );
+        }
+      }
+      auto chunk = static_cast<uint8_t*>( backingAllocate( c_chunkSize ) );
+      if ( !chunk )
+        return nullptr;
+      chunks_.push_back( chunk );
+      counters_.bytesReserved.fetch_add( c_chunkSize, std::memory_order_relaxed );
+      cursor_ = chunk;
+      remaining_ = c_chunkSize;
+    }
+    auto block = cursor_;
+    cursor_ += size;
+    remaining_ -= size;
+    return block;
+  }
+
+  void* PoolAllocator::allocate( size_t size )
+  {
+    const auto total = ( size + sizeof( BlockHeader ) );
+    size_t sizeClass = 0;
+    while ( sizeClass < c_classCount && classSize( sizeClass ) < total )
+      ++sizeClass;
+
+    BlockHeader* header = nullptr;
+    if ( sizeClass == c_classCount )
+    {
+      header = static_cast<BlockHeader*>( backingAllocate( total ) );
+      if ( !header )
+        return nullptr;
+      counters_.largeAllocations.fetch_add( 1, std::memory_order_relaxed );
+    }
+    else
+    {
+      {
+        lock_guard<mutex> lock( lock_ );
+        if ( freeLists_[sizeClass] )
+        {
+          header = reinterpret_cast<BlockHeader*>( freeLists_[sizeClass] );
+          freeLists_[sizeClass] = freeLists_[sizeClass]->next;
+        }
+        else
+          header = static_cast<BlockHeader*>( carve( sizeClass ) );
+      }
+      if ( !header )
+        return nullptr;
+      counters_.poolAllocations.fetch_add( 1, std::memory_order_relaxed );
+    }
+
+    header->sizeClass = static_cast<uint32_t>( sizeClass );
+    header->size = static_cast<uint32_t>( size );
+    counters_.bytesInUse.fetch_add( static_cast<int64_t>( size ), std::memory_order_relaxed );
+    return ( header + 1 );
+  }
+
+  void* PoolAllocator::reallocate( void* address, size_t size )
+  {
+    if ( !address )
+      return allocate( size );
+    if ( size == 0 )
+    {
+      free( address );
+      return nullptr;
+    }
+
+    auto header = static_cast<BlockHeader*>( address ) - 1;
+    // Shrinking, or growing within the block, stays put
+    if ( header->sizeClass < c_classCount && ( size + sizeof( BlockHeader ) ) <= classSize( header->sizeClass ) )
+    {
+      counters_.bytesInUse.fetch_add( static_cast<int64_t>( size ) - static_cast<int64_t>( header->size ), std::memory_order_relaxed );
+      header->size = static_cast<uint32_t>( size );
+      return address;
+    }
+
+    auto moved = allocate( size );
+    if ( !moved )
+      return nullptr;
+    memcpy( moved, address, std::min( size, static_cast<size_t>( header->size ) ) );
+    free( address );
+    return moved;
+  }
+
+  void PoolAllocator::free( void* address )
+  {
+    if ( !address )
+      return;
+
+    auto header = static_cast<BlockHeader*>( address ) - 1;
+    counters_.bytesInUse.fetch_sub( static_cast<int64_t>( header->size ), std::memory_order_relaxed );
+
+    if ( header->sizeClass == c_classCount )
+    {
+      backingFree( header );
+      return;
+    }
+
+    const auto sizeClass = header->sizeClass;
+    auto block = reinterpret_cast<FreeBlock*>( header );
+    {
+      lock_guard<mutex> lock( lock_ );
+      block->next = freeLists_[sizeClass];
+      freeLists_[sizeClass] = block;
+    }
+    counters_.poolFrees.fetch_add( 1, std::memory_order_relaxed );
+  }
+
+  PoolAllocator::~PoolAllocator()
+  {
+    for ( auto chunk : chunks_ )
+    {
+      backingFree( chunk );
+      counters_.bytesReserved.fetch_sub( c_chunkSize, std::memory_order_relaxed );
+    }
+  }
+
+  // SCRATCH ARENA ===========================================================
+
+  ScratchArena::ScratchArena( Host* host, MemoryCounters& counters ): host_( host ), counters_( counters )
+  {
+  }
+
+  uint8_t* ScratchArena::allocate( size_t size )
+  {
+    // Keep everything 16-byte aligned
+    size = ( size + 15 ) & ~static_cast<size_t>( 15 );
+
+    if ( blocks_.empty() || ( used_ + size ) > blocks_.back().second )
+    {
+      const auto capacity = std::max( size, blocks_.empty() ? static_cast<size_t>( 4096 ) : blocks_.back().second * 2 );
+      auto block = static_cast<uint8_t*>( host_->newtypeMemoryAllocate( static_cast<uint32_t>( capacity ) ) );
+      if ( !block )
+        NEWTYPE_EXCEPT( "Scratch memory allocation failed" );
+      counters_.hostAllocations.fetch_add( 1, std::memory_order_relaxed );
+      counters_.bytesReserved.fetch_add( static_cast<int64_t>( capacity ), std::memory_order_relaxed );
+      blocks_.emplace_back( block, capacity );
+      used_ = 0;
+    }
+
+    auto address = blocks_.back().first + used_;
+    used_ += size;
+    return address;
+  }
+
+  void ScratchArena::reset()
+  {
+    used_ = 0;
+    if ( blocks_.size() < 2 )
+      return;
+
+    // Outgrew the first block at some point; swap them all for one that fits everything next time
+    size_t total = 0;
+    for ( const auto& block : blocks_ )
+    {
+      total += block.second;
+      host_->newtypeMemoryFree( block.first );
+      counters_.hostFrees.fetch_add( 1, std::memory_order_relaxed );
+    }
+    counters_.bytesReserved.fetch_sub( static_cast<int64_t>( total ), std::memory_order_relaxed );
+    blocks_.clear();
+
+    auto block = static_cast<uint8_t*>( host_->newtypeMemoryAllocate( static_cast<uint32_t>( total ) ) );
+    if ( !block )
+      return;
+    counters_.hostAllocations.fetch_add( 1, std::memory_order_relaxed );
+    counters_.bytesReserved.fetch_add( static_cast<int64_t>( total ), std::memory_order_relaxed );
+    blocks_.emplace_back( block, total );
+  }
+
+  ScratchArena::~ScratchArena()
+  {
+    for ( const auto& block : blocks_ )
+    {
+      host_->newtypeMemoryFree( block.first );
+      counters_.hostFrees.fetch_add( 1, std::memory_order_relaxed );
+      counters_.bytesReserved.fetch_sub( static_cast<int64_t>( block.second ), std::memory_order_relaxed );
+    }
+  }
+
+  // HARFBUZZ ================================================================
+
+#ifdef NEWTYPE_HARFBUZZ_ALLOCATOR
+
+  // For a HarfBuzz built with hb_malloc_impl=newtype_hb_malloc, hb_calloc_impl=newtype_hb_calloc,
+  // hb_realloc_impl=newtype_hb_realloc and hb_free_impl=newtype_hb_free.
+  // HarfBuzz keeps some objects around for the life of the process and has no context to pass,
+  // so this pool is process-wide, malloc-backed and never torn down.
+
+  static MemoryCounters g_harfBuzzCounters;
+
+  static PoolAllocator& harfBuzzPool()
+  {
+    static auto pool = new PoolAllocator( nullptr, g_harfBuzzCounters );
+    return *pool;
+  }
+
+  const MemoryCounters* harfBuzzMemoryCounters()
+  {
+    return &g_harfBuzzCounters;
+  }
+
+}
+
+extern "C" {
+
+  void* newtype_hb_malloc( size_t size )
+  {
+    return newtype::harfBuzzPool().allocate( size );
+  }
+
+  void* newtype_hb_calloc( size_t count, size_t size )
+  {
+    if ( size && count > ( std::numeric_limits<size_t>::max() / size ) )
+      return nullptr;
+    auto address = newtype::harfBuzzPool().allocate( count * size );
+    if ( address )
+      memset( address, 0, count * size );
+    return address;
+  }
+
+  void* newtype_hb_realloc( void* address, size_t size )
+  {
+    return newtype::harfBuzzPool().reallocate( address, size );
+  }
+
+  void newtype_hb_free( void* address )
+  {
+    newtype::harfBuzzPool().free( address );
+  }
+
+}
+
+#else
+
+  const MemoryCounters* harfBuzzMemoryCounters()
+  {
+    return nullptr;
+  }
+
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,350 @@
+#include "pch.h"
+#include "newtype_mesh.h"
+
+// Kernel selection is compile time; AVX2 comes with /arch:AVX2 (or -mavx2), SSE2 is the x64 baseline.
+// Define NEWTYPE_NO_SIMD to build the scalar paths only.
+#if !defined( NEWTYPE_NO_SIMD )
+# if defined( __AVX2__ )
+#  include <immintrin.h>
+#  define NEWTYPE_SIMD_AVX2
+#  define NEWTYPE_SIMD_SSE2
+# elif defined( _M_X64 ) || defined( __SSE2__ ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#  include <emmintrin.h>
+#  define NEWTYPE_SIMD_SSE2
+# elif defined( __aarch64__ ) || defined( _M_ARM64 )
+#  include <arm_neon.h>
+#  define NEWTYPE_SIMD_NEON
+# endif
+#endif
+
+namespace newtype {
+
+  size_t GlyphQuads::size() const
+  {
+    return x0.size();
+  }
+
+  void GlyphQuads::resize( size_t count )
+  {
+    for ( auto array : { &originX, &originY, &bearingX, &bearingY, &width, &height, &x0, &y0, &x1, &y1, &u0, &v0, &u1, &v1 } )
+      array->resize( count );
+    color.resize( count );
+  }
+
+  void GlyphQuads::reserve( size_t count, size_t colors )
+  {
+    for ( auto array : { &originX, &originY, &bearingX, &bearingY, &width, &height, &x0, &y0, &x1, &y1, &u0, &v0, &u1, &v1 } )
+      array->reserve( count );
+    color.reserve( count );
+    palette.reserve( colors );
+    packedPalette.reserve( colors );
+  }
+
+  size_t meshElementSize( MeshFormat format )
+  {
+    if ( format == MeshFormat_Instances )
+      return sizeof( GlyphInstance );
+    if ( format == MeshFormat_CompactQuads )
+      return sizeof( CompactVertex );
+    return sizeof( Vertex );
+  }
+
+  size_t meshElementsPerQuad( MeshFormat format )
+  {
+    return ( format == MeshFormat_Instances ? 1 : 4 );
+  }
+
+#ifdef NEWTYPE_SIMD_SSE2
+  // SSE2 has no floor; truncate and step down where that went up
+  static inline __m128 floorSSE2( __m128 value )
+  {
+    const auto truncated = _mm_cvtepi32_ps( _mm_cvttps_epi32( value ) );
+    return _mm_sub_ps( truncated, _mm_and_ps( _mm_cmpgt_ps( truncated, value ), _mm_set1_ps( 1.0f ) ) );
+  }
+#endif
+
+  void computeQuadCorners( GlyphQuads& quads, size_t first, size_t end )
+  {
+    // Glyph tops are snapped to whole pixels
+    size_t i = first;
+#ifdef NEWTYPE_SIMD_AVX2
+    for ( ; ( i + 8 ) <= end; i += 8 )
+    {
+      const auto x0 = _mm256_add_ps( _mm256_loadu_ps( &quads.originX[i] ), _mm256_loadu_ps( &quads.bearingX[i] ) );
+      const auto y0 = _mm256_floor_ps( _mm256_sub_ps( _mm256_loadu_ps( &quads.originY[i] ), _mm256_loadu_ps( &quads.bearingY[i] ) ) );
+      _mm256_storeu_ps( &quads.x0[i], x0 );
+      _mm256_storeu_ps( &quads.y0[i], y0 );
+      _mm256_storeu_ps( &quads.x1[i], _mm256_add_ps( x0, _mm256_loadu_ps( &quads.width[i] ) ) );
+      _mm256_storeu_ps( &quads.y1[i], _mm256_add_ps( y0, _mm256_loadu_ps( &quads.height[i] ) ) );
+    }
+#endif
+#if defined( NEWTYPE_SIMD_SSE2 )
+    for ( ; ( i + 4 ) <= end; i += 4 )
+    {
+      const auto x0 = _mm_add_ps( _mm_loadu_ps( &quads.originX[i] ), _mm_loadu_ps( &quads.bearingX[i] ) );
+      const auto y0 = floorSSE2( _mm_sub_ps( _mm_loadu_ps( &quads.originY[i] ), _mm_loadu_ps( &quads.bearingY[i] ) ) );
+      _mm_storeu_ps( &quads.x0[i], x0 );
+      _mm_storeu_ps( &quads.y0[i], y0 );
+      _mm_storeu_ps( &quads.x1[i], _mm_add_ps( x0, _mm_loadu_ps( &quads.width[i] ) ) );
+      _mm_storeu_ps( &quads.y1[i], _mm_add_ps( y0, _mm_loadu_ps( &quads.height[i] ) ) );
+    }
+#elif defined( NEWTYPE_SIMD_NEON )
+    for ( ; ( i + 4 ) <= end; i += 4 )
+    {
+      const auto x0 = vaddq_f32( vld1q_f32( &quads.originX[i] ), vld1q_f32( &quads.bearingX[i] ) );
+      const auto y0 = vrndmq_f32( vsubq_f32( vld1q_f32( &quads.originY[i] ), vld1q_f32( &quads.bearingY[i] ) ) );
+      vst1q_f32( &quads.x0[i], x0 );
+      vst1q_f32( &quads.y0[i], y0 );
+      vst1q_f32( &quads.x1[i], vaddq_f32( x0, vld1q_f32( &quads.width[i] ) ) );
+      vst1q_f32( &quads.y1[i], vaddq_f32( y0, vld1q_f32( &quads.height[i] ) ) );
+    }
+#endif
+    for ( ; i < end; ++i )
+    {
+      quads.x0[i] = ( quads.originX[i] + quads.bearingX[i] );
+      quads.y0[i] = ::floorf( quads.originY[i] - quads.bearingY[i] );
+      quads.x1[i] = ( quads.x0[i] + quads.width[i] );
+      quads.y1[i] = ( quads.y0[i] + quads.height[i] );
+    }
+  }
+
+  size_t clipQuads( GlyphQuads& quads, size_t first, size_t end, const vec4& rect )
+  {
+    auto crop = []( Real& p0, Real& p1, Real& uv0, Real& uv1, Real low, Real high ) {
+      const auto length = ( p1 - p0 );
+      if ( length <= 0.0f )
+        return;
+      const auto texels = ( uv1 - uv0 );
+      if ( p0 < low )
+      {
+        uv0 += ( ( low - p0 ) / length ) * texels;
+        p0 = low;
+      }
+      if ( p1 > high )
+      {
+        uv1 -= ( ( p1 - high ) / length ) * texels;
+        p1 = high;
+      }
+    };
+
+    // Survivors are moved down over the dropped ones; only the fields expansion reads are kept
+    auto out = first;
+    for ( auto i = first; i < end; ++i )
+    {
+      if ( quads.x1[i] <= rect.x || quads.x0[i] >= rect.z || quads.y1[i] <= rect.y || quads.y0[i] >= rect.w )
+        continue;
+      quads.x0[out] = quads.x0[i];
+      quads.y0[out] = quads.y0[i];
+      quads.x1[out] = quads.x1[i];
+      quads.y1[out] = quads.y1[i];
+      quads.u0[out] = quads.u0[i];
+      quads.v0[out] = quads.v0[i];
+      quads.u1[out] = quads.u1[i];
+      quads.v1[out] = quads.v1[i];
+      quads.color[out] = quads.color[i];
+      crop( quads.x0[out], quads.x1[out], quads.u0[out], quads.u1[out], rect.x, rect.z );
+      crop( quads.y0[out], quads.y1[out], quads.v0[out], quads.v1[out], rect.y, rect.w );
+      ++out;
+    }
+    return out;
+  }
+
+  // Vertex is nine packed floats: position, texcoord, color
+  static inline void writeVertex( float* out, Real x, Real y, Real z, Real u, Real v, const vec4& color )
+  {
+    out[0] = x;
+    out[1] = y;
+    out[2] = z;
+    out[3] = u;
+    out[4] = v;
+    out[5] = color.x;
+    out[6] = color.y;
+    out[7] = color.z;
+    out[8] = color.w;
+  }
+
+#if defined( NEWTYPE_SIMD_SSE2 )
+  // One quad from its x0 y0 x1 y1 and u0 v0 u1 v1, two stores and the alpha per vertex
+  static inline void writeQuadSSE2( float* out, __m128 p, __m128 t, __m128 z, __m128 color )
+  {
+    const auto zu = _mm_unpacklo_ps( z, _mm_shuffle_ps( t, t, _MM_SHUFFLE( 2, 0, 2, 0 ) ) ); // z u0 z u1
+    const auto vr = _mm_shuffle_ps( t, color, _MM_SHUFFLE( 0, 0, 3, 1 ) ); // v0 v1 r r
+    const auto v0rgb = _mm_shuffle_ps( vr, color, _MM_SHUFFLE( 2, 1, 2, 0 ) );
+    const auto v1rgb = _mm_shuffle_ps( vr, color, _MM_SHUFFLE( 2, 1, 2, 1 ) );
+    const auto alpha = _mm_cvtss_f32( _mm_shuffle_ps( color, color, _MM_SHUFFLE( 3, 3, 3, 3 ) ) );
+
+    _mm_storeu_ps( out + 0, _mm_shuffle_ps( p, zu, _MM_SHUFFLE( 1, 0, 1, 0 ) ) ); // x0 y0 z u0
+    _mm_storeu_ps( out + 4, v0rgb );
+    out[8] = alpha;
+    _mm_storeu_ps( out + 9, _mm_shuffle_ps( p, zu, _MM_SHUFFLE( 1, 0, 3, 0 ) ) ); // x0 y1 z u0
+    _mm_storeu_ps( out + 13, v1rgb );
+    out[17] = alpha;
+    _mm_storeu_ps( out + 18, _mm_shuffle_ps( p, zu, _MM_SHUFFLE( 3, 2, 3, 2 ) ) ); // x1 y1 z u1
+    _mm_storeu_ps( out + 22, v1rgb );
+    out[26] = alpha;
+    _mm_storeu_ps( out + 27, _mm_shuffle_ps( p, zu, _MM_SHUFFLE( 3, 2, 1, 2 ) ) ); // x1 y0 z u1
+    _mm_storeu_ps( out + 31, v0rgb );
+    out[35] = alpha;
+  }
+#elif defined( NEWTYPE_SIMD_NEON )
+  static inline void writeQuadNEON( float* out, float32x4_t p, float32x4_t t, Real z, float32x4_t color )
+  {
+    const auto x0y0 = vget_low_f32( p );
+    const auto x1y1 = vget_high_f32( p );
+    const auto lowLane = vcreate_u32( 0x00000000FFFFFFFFull );
+    const auto x0y1 = vbsl_f32( lowLane, x0y0, x1y1 );
+    const auto x1y0 = vbsl_f32( lowLane, x1y1, x0y0 );
+    const auto zu0 = vset_lane_f32( vgetq_lane_f32( t, 0 ), vdup_n_f32( z ), 1 );
+    const auto zu1 = vset_lane_f32( vgetq_lane_f32( t, 2 ), vdup_n_f32( z ), 1 );
+    const auto v0rgb = vextq_f32( vdupq_laneq_f32( t, 1 ), color, 3 );
+    const auto v1rgb = vextq_f32( vdupq_laneq_f32( t, 3 ), color, 3 );
+    const auto alpha = vgetq_lane_f32( color, 3 );
+
+    vst1q_f32( out + 0, vcombine_f32( x0y0, zu0 ) );
+    vst1q_f32( out + 4, v0rgb );
+    out[8] = alpha;
+    vst1q_f32( out + 9, vcombine_f32( x0y1, zu0 ) );
+    vst1q_f32( out + 13, v1rgb );
+    out[17] = alpha;
+    vst1q_f32( out + 18, vcombine_f32( x1y1, zu1 ) );
+    vst1q_f32( out + 22, v1rgb );
+    out[26] = alpha;
+    vst1q_f32( out + 27, vcombine_f32( x1y0, zu1 ) );
+    vst1q_f32( out + 31, v0rgb );
+    out[35] = alpha;
+  }
+#endif
+
+  static void expandVertices( const GlyphQuads& quads, size_t first, size_t count, Real depth, float* out )
+  {
+    static_assert( sizeof( Vertex ) == 9 * sizeof( float ), "Vertex layout changed" );
+
+    const auto end = ( first + count );
+    auto i = first;
+#if defined( NEWTYPE_SIMD_SSE2 )
+    const auto z = _mm_set1_ps( depth );
+    for ( ; ( i + 4 ) <= end; i += 4 )
+    {
+      // Four quads at a time, transposed into one register per quad
+      auto p0 = _mm_loadu_ps( &quads.x0[i] ), p1 = _mm_loadu_ps( &quads.y0[i] );
+      auto p2 = _mm_loadu_ps( &quads.x1[i] ), p3 = _mm_loadu_ps( &quads.y1[i] );
+      auto t0 = _mm_loadu_ps( &quads.u0[i] ), t1 = _mm_loadu_ps( &quads.v0[i] );
+      auto t2 = _mm_loadu_ps( &quads.u1[i] ), t3 = _mm_loadu_ps( &quads.v1[i] );
+      _MM_TRANSPOSE4_PS( p0, p1, p2, p3 );
+      _MM_TRANSPOSE4_PS( t0, t1, t2, t3 );
+      const auto& palette = quads.palette;
+      writeQuadSSE2( out, p0, t0, z, _mm_loadu_ps( &palette[quads.color[i]].x ) );
+      writeQuadSSE2( out + 36, p1, t1, z, _mm_loadu_ps( &palette[quads.color[i + 1]].x ) );
+      writeQuadSSE2( out + 72, p2, t2, z, _mm_loadu_ps( &palette[quads.color[i + 2]].x ) );
+      writeQuadSSE2( out + 108, p3, t3, z, _mm_loadu_ps( &palette[quads.color[i + 3]].x ) );
+      out += 144;
+    }
+#elif defined( NEWTYPE_SIMD_NEON )
+    for ( ; ( i + 4 ) <= end; i += 4 )
+    {
+      // Interleaving stores do the transpose
+      float corners[16];
+      float texcoords[16];
+      vst4q_f32( corners, { { vld1q_f32( &quads.x0[i] ), vld1q_f32( &quads.y0[i] ), vld1q_f32( &quads.x1[i] ), vld1q_f32( &quads.y1[i] ) } } );
+      vst4q_f32( texcoords, { { vld1q_f32( &quads.u0[i] ), vld1q_f32( &quads.v0[i] ), vld1q_f32( &quads.u1[i] ), vld1q_f32( &quads.v1[i] ) } } );
+      for ( size_t j = 0; j < 4; ++j, out += 36 )
+        writeQuadNEON( out, vld1q_f32( corners + j * 4 ), vld1q_f32( texcoords + j * 4 ), depth, vld1q_f32( &quads.palette[quads.color[i + j]].x ) );
+    }
+#endif
+    for ( ; i < end; ++i, out += 36 )
+    {
+      const auto& color = quads.palette[quads.color[i]];
+      writeVertex( out + 0, quads.x0[i], quads.y0[i], depth, quads.u0[i], quads.v0[i], color );
+      writeVertex( out + 9, quads.x0[i], quads.y1[i], depth, quads.u0[i], quads.v1[i], color );
+      writeVertex( out + 18, quads.x1[i], quads.y1[i], depth, quads.u1[i], quads.v1[i], color );
+      writeVertex( out + 27, quads.x1[i], quads.y0[i], depth, quads.u1[i], quads.v0[i], color );
+    }
+  }
+
+  static void expandInstances( const GlyphQuads& quads, size_t first, size_t count, Real depth, uint8_t* destination )
+  {
+    static_assert( sizeof( GlyphInstance ) == 10 * sizeof( float ), "GlyphInstance layout changed" );
+
+    // Each instance is x y z, width height, u0 v0 u1 v1 and the packed color
+    auto out = reinterpret_cast<float*>( destination );
+    const auto end = ( first + count );
+    auto i = first;
+#if defined( NEWTYPE_SIMD_SSE2 )
+    for ( ; ( i + 4 ) <= end; i += 4, out += 40 )
+    {
+      const auto x0 = _mm_loadu_ps( &quads.x0[i] ), y0 = _mm_loadu_ps( &quads.y0[i] );
+      auto a0 = x0, a1 = y0, a2 = _mm_set1_ps( depth ), a3 = _mm_sub_ps( _mm_loadu_ps( &quads.x1[i] ), x0 );
+      auto b0 = _mm_sub_ps( _mm_loadu_ps( &quads.y1[i] ), y0 ), b1 = _mm_loadu_ps( &quads.u0[i] );
+      auto b2 = _mm_loadu_ps( &quads.v0[i] ), b3 = _mm_loadu_ps( &quads.u1[i] );
+      _MM_TRANSPOSE4_PS( a0, a1, a2, a3 );
+      _MM_TRANSPOSE4_PS( b0, b1, b2, b3 );
+      const __m128 heads[4] = { a0, a1, a2, a3 };
+      const __m128 tails[4] = { b0, b1, b2, b3 };
+      for ( size_t j = 0; j < 4; ++j )
+      {
+        _mm_storeu_ps( out + j * 10, heads[j] );
+        _mm_storeu_ps( out + j * 10 + 4, tails[j] );
+        out[j * 10 + 8] = quads.v1[i + j];
+        memcpy( out + j * 10 + 9, &quads.packedPalette[quads.color[i + j]], sizeof( uint32_t ) );
+      }
+    }
+#elif defined( NEWTYPE_SIMD_NEON )
+    for ( ; ( i + 4 ) <= end; i += 4, out += 40 )
+    {
+      const auto x0 = vld1q_f32( &quads.x0[i] ), y0 = vld1q_f32( &quads.y0[i] );
+      float heads[16];
+      float tails[16];
+      vst4q_f32( heads, { { x0, y0, vdupq_n_f32( depth ), vsubq_f32( vld1q_f32( &quads.x1[i] ), x0 ) } } );
+      vst4q_f32( tails, { { vsubq_f32( vld1q_f32( &quads.y1[i] ), y0 ), vld1q_f32( &quads.u0[i] ), vld1q_f32( &quads.v0[i] ), vld1q_f32( &quads.u1[i] ) } } );
+      for ( size_t j = 0; j < 4; ++j )
+      {
+        vst1q_f32( out + j * 10, vld1q_f32( heads + j * 4 ) );
+        vst1q_f32( out + j * 10 + 4, vld1q_f32( tails + j * 4 ) );
+        out[j * 10 + 8] = quads.v1[i + j];
+        memcpy( out + j * 10 + 9, &quads.packedPalette[quads.color[i + j]], sizeof( uint32_t ) );
+      }
+    }
+#endif
+    for ( ; i < end; ++i, out += 10 )
+    {
+      out[0] = quads.x0[i];
+      out[1] = quads.y0[i];
+      out[2] = depth;
+      out[3] = ( quads.x1[i] - quads.x0[i] );
+      out[4] = ( quads.y1[i] - quads.y0[i] );
+      out[5] = quads.u0[i];
+      out[6] = quads.v0[i];
+      out[7] = quads.u1[i];
+      out[8] = quads.v1[i];
+      memcpy( out + 9, &quads.packedPalette[quads.color[i]], sizeof( uint32_t ) );
+    }
+  }
+
+  static void expandCompact( const GlyphQuads& quads, size_t first, size_t count, CompactVertex* out )
+  {
+    // Quantization rounds half away from zero like quantizePosition(), which SIMD conversions don't
+    for ( auto i = first; i < ( first + count ); ++i, out += 4 )
+    {
+      const int16_t x0 = quantizePosition( quads.x0[i] ), y0 = quantizePosition( quads.y0[i] );
+      const int16_t x1 = quantizePosition( quads.x1[i] ), y1 = quantizePosition( quads.y1[i] );
+      const uint16_t u0 = quantizeTexcoord( quads.u0[i] ), v0 = quantizeTexcoord( quads.v0[i] );
+      const uint16_t u1 = quantizeTexcoord( quads.u1[i] ), v1 = quantizeTexcoord( quads.v1[i] );
+      const auto color = quads.packedPalette[quads.color[i]];
+      out[0] = { { x0, y0 }, { u0, v0 }, color };
+      out[1] = { { x0, y1 }, { u0, v1 }, color };
+      out[2] = { { x1, y1 }, { u1, v1 }, color };
+      out[3] = { { x1, y0 }, { u1, v0 }, color };
+    }
+  }
+
+  void expandQuads( const GlyphQuads& quads, size_t first, size_t count, MeshFormat format, Real depth, uint8_t* destination )
+  {
+    if ( format == MeshFormat_Instances )
+      expandInstances( quads, first, count, depth, destination );
+    else if ( format == MeshFormat_CompactQuads )
+      expandCompact( quads, first, count, reinterpret_cast<CompactVertex*>( destination ) );
+    else
+      expandVertices( quads, first, count, depth, reinterpret_cast<float*>( destination ) );
+  }
+
+}
\ No newline at end of file
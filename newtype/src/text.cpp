@@ -3,6 +3,11 @@
 #include "newtype_font.h"
 #include "newtype_manager.h"
 
+// Debug builds cross-check every Basic Latin fast path result against HarfBuzz
+#if defined( _DEBUG ) && !defined( NEWTYPE_VERIFY_FASTPATH )
+# define NEWTYPE_VERIFY_FASTPATH
+#endif
+
 namespace newtype {
 
   Text::~Text()
@@ -28,21 +33,45 @@ namespace newtype {
   TextImpl::TextImpl( ManagerImpl* manager, IDType id, FontFacePtr face, StyleID style, const Text::Features& features ):
   manager_( manager ), id_( id ), face_( move( face ) ), style_( style )
   {
-    hbbuf_ = hb_buffer_create();
-    string lang = "en";
-    language_ = hb_language_from_string( lang.c_str(), static_cast<int>( lang.size() ) );
+    language_ = defaultLanguage();
     script_ = HB_SCRIPT_LATIN;
     direction_ = HB_DIRECTION_LTR;
 
-    features_.push_back( features.kerning ? features::KerningOn : features::KerningOff );
-    features_.push_back( features.ligatures ? features::LigatureOn : features::LigatureOff );
-    features_.push_back( features.ligatures ? features::CligOn : features::CligOff );
+    setFeatures( features );
+  }
+
+  template <typename T>
+  inline size_t heldBytes( const T& container )
+  {
+    return ( container.capacity() * sizeof( typename T::value_type ) );
+  }
+
+  // Drops a container's storage. Skipped when there's none, since even an empty temporary
+  // allocates under iterator debugging.
+  template <typename T>
+  inline void releaseStorage( T& container )
+  {
+    if ( container.capacity() > 0 )
+      T().swap( container );
+  }
+
+  size_t TextImpl::textBytes() const
+  {
+    return ( heldBytes( utf8_ ) + heldBytes( utf16_ ) + heldBytes( runs_ ) + heldBytes( shapingRuns_ ) + heldBytes( groups_ )
+      + heldBytes( features_ ) + heldBytes( shaped_ ) + heldBytes( positions_ ) + heldBytes( lines_ ) + heldBytes( misses_ ) );
   }
 
-  TextImpl::~TextImpl()
+  size_t TextImpl::meshBytes() const
   {
-    if ( hbbuf_ )
-      hb_buffer_destroy( hbbuf_ );
+    auto bytes = []( const Mesh& mesh ) {
+      return ( heldBytes( mesh.vertices_ ) + heldBytes( mesh.indices_ ) + heldBytes( mesh.compactVertices_ )
+        + heldBytes( mesh.instances_ ) + heldBytes( mesh.groups_ ) );
+    };
+    auto total = bytes( mesh_ );
+    if ( buffers_ )
+      for ( const auto& buffer : *buffers_ )
+        total += bytes( buffer );
+    return total;
   }
 
   IDType TextImpl::id() const
@@ -50,113 +79,930 @@ namespace newtype {
     return id_;
   }
 
+  bool TextImpl::textChanged( Encoding encoding, const void* data, size_t length, size_t unitSize )
+  {
+    // Length plus hash, so that unchanged text costs neither a copy nor a full compare
+    const auto hash = hashBytes( data, length * unitSize );
+    if ( encoding == encoding_ && length == textLength_ && hash == textHash_ )
+      return false;
+    encoding_ = encoding;
+    textLength_ = length;
+    textHash_ = hash;
+    return true;
+  }
+
   void TextImpl::setText( const unicodeString& text )
   {
-    if ( text_ != text )
-    {
-      text_ = text;
-      dirty_ = true;
-    }
+    setText( u16string_view( text.getBuffer(), static_cast<size_t>( text.length() ) ) );
   }
 
-  void TextImpl::regenerate()
+  void TextImpl::setText( string_view utf8 )
+  {
+    if ( !textChanged( Encoding_UTF8, utf8.data(), utf8.size(), sizeof( char ) ) )
+      return;
+    utf8_.assign( utf8.data(), utf8.size() );
+    utf16_.clear();
+    dirty_ = true;
+  }
+
+  void TextImpl::setText( u16string_view utf16 )
+  {
+    if ( !textChanged( Encoding_UTF16, utf16.data(), utf16.size(), sizeof( char16_t ) ) )
+      return;
+    utf16_.assign( utf16.data(), utf16.size() );
+    utf8_.clear();
+    dirty_ = true;
+  }
+
+  void TextImpl::setLanguage( string_view language )
+  {
+    auto lang = ( language.empty() ? HB_LANGUAGE_INVALID : hb_language_from_string( language.data(), static_cast<int>( language.size() ) ) );
+    if ( lang == language_ )
+      return;
+    language_ = lang;
+    dirty_ = true;
+  }
+
+  void TextImpl::setScript( string_view script )
+  {
+    auto scr = ( script.empty() ? HB_SCRIPT_INVALID : hb_script_from_string( script.data(), static_cast<int>( script.size() ) ) );
+    if ( scr == script_ )
+      return;
+    script_ = scr;
+    dirty_ = true;
+  }
+
+  void TextImpl::setDirection( TextDirection direction )
+  {
+    hb_direction_t dir = HB_DIRECTION_INVALID;
+    if ( direction == TextDirection_LeftToRight )
+      dir = HB_DIRECTION_LTR;
+    else if ( direction == TextDirection_RightToLeft )
+      dir = HB_DIRECTION_RTL;
+    if ( dir == direction_ )
+      return;
+    direction_ = dir;
+    dirty_ = true;
+  }
+
+  void TextImpl::setRuns( span<const TextRun> runs )
   {
-    auto fce = FONTFACE_IMPL_CAST( face_ );
+    runs_.assign( runs.begin(), runs.end() );
+    dirty_ = true;
+  }
 
-    if ( !dirty_ || !fce || !fce->font_->loaded() )
+  void TextImpl::setFeatures( const Features& features )
+  {
+    defaultFeatures_ = ( features.kerning && features.ligatures );
+    features_.clear();
+    features_.push_back( features.kerning ? features::KerningOn : features::KerningOff );
+    features_.push_back( features.ligatures ? features::LigatureOn : features::LigatureOff );
+    features_.push_back( features.ligatures ? features::CligOn : features::CligOff );
+
+    auto hash = hashBytes( features_.data(), features_.size() * sizeof( hb_feature_t ) );
+    if ( hash == featuresHash_ )
       return;
+    featuresHash_ = hash;
+    dirty_ = true;
+  }
+
+  UChar32 TextImpl::codepointAt( uint32_t cluster ) const
+  {
+    UChar32 codepoint = 0;
+    if ( encoding_ == Encoding_UTF8 )
+    {
+      auto length = static_cast<int32_t>( utf8_.size() );
+      U8_GET( reinterpret_cast<const uint8_t*>( utf8_.data() ), 0, static_cast<int32_t>( cluster ), length, codepoint );
+    }
+    else
+    {
+      auto length = static_cast<int32_t>( utf16_.size() );
+      U16_GET( utf16_.data(), 0, static_cast<int32_t>( cluster ), length, codepoint );
+    }
+    return codepoint;
+  }
 
-    FontStyleImpl* style = nullptr;
+  bool TextImpl::addShapingRun( size_t start, size_t length, const FontFacePtr& face, StyleID style, const vec4& color )
+  {
+    auto fce = FONTFACE_IMPL_CAST( face );
+    if ( !fce || !fce->font_ || !fce->font_->loaded() )
+      return false;
+
+    ShapingRun run;
     {
-      auto pimpl = fce->getStyle( style_ );
-      style = FONTSTYLE_IMPL_CAST( pimpl );
-      if ( !style )
+      auto pimpl = fce->getStyle( style );
+      run.style = FONTSTYLE_IMPL_CAST( pimpl );
+      if ( !run.style )
         NEWTYPE_EXCEPT( "Style implementation cast failed" );
     }
+    run.start = static_cast<uint32_t>( start );
+    run.length = static_cast<uint32_t>( length );
+    run.face = fce;
+    run.color = color;
+
+    auto group = std::find( groups_.begin(), groups_.end(), run.style );
+    run.group = static_cast<uint32_t>( group - groups_.begin() );
+    if ( group == groups_.end() )
+      groups_.push_back( run.style );
+
+    // Lines are as tall as the tallest face in the text
+    if ( shapingRuns_.empty() )
+    {
+      ascender_ = fce->ascender();
+      descender_ = fce->descender();
+    }
+    else
+    {
+      ascender_ = glm::max( ascender_, fce->ascender() );
+      descender_ = glm::min( descender_, fce->descender() );
+    }
 
-    // TODO handle special case where textdata doesn't exist (= generate empty mesh)
+    shapingRuns_.push_back( run );
+    return true;
+  }
 
-    hb_buffer_reset( hbbuf_ );
+  bool TextImpl::resolveRuns()
+  {
+    shapingRuns_.clear();
+    groups_.clear();
 
-    hb_buffer_set_direction( hbbuf_, direction_ );
-    hb_buffer_set_script( hbbuf_, script_ );
-    hb_buffer_set_language( hbbuf_, language_ );
+    size_t start = 0;
+    for ( const auto& run : runs_ )
+    {
+      const auto length = std::min( run.length, textLength_ - start );
+      if ( length == 0 )
+        continue;
+      if ( !addShapingRun( start, length, run.face ? run.face : face_, run.face ? run.style : style_, run.color ) )
+        return false;
+      start += length;
+    }
 
-    uint32_t flags = hb_buffer_get_flags( hbbuf_ );
-    flags |= HB_BUFFER_FLAG_BOT;
-    flags |= HB_BUFFER_FLAG_EOT;
-    hb_buffer_set_flags( hbbuf_, static_cast<hb_buffer_flags_t>( flags ) );
+    if ( start < textLength_ || shapingRuns_.empty() )
+      return addShapingRun( start, textLength_ - start, face_, style_, color_ );
 
-    hb_buffer_add_utf16( hbbuf_, reinterpret_cast<const uint16_t*>( text_.getBuffer() ), text_.length(), 0, text_.length() );
+    return true;
+  }
 
-    hb_shape(
-      fce->hbfnt_,
-      hbbuf_,
-      features_.empty() ? nullptr : features_.data(), static_cast<int>( features_.size() )
-    );
+  bool TextImpl::shapeBasicLatin( uint32_t runIndex, hb_direction_t direction )
+  {
+    // The table's pairs were shaped with nothing but these
+    if ( direction != HB_DIRECTION_LTR && direction != HB_DIRECTION_INVALID )
+      return false;
+    if ( script_ != HB_SCRIPT_LATIN || language_ != defaultLanguage() || !defaultFeatures_ )
+      return false;
 
-    auto position = pen_;
+    // In both encodings every Basic Latin code unit is a whole codepoint and its own cluster
+    const auto& run = shapingRuns_[runIndex];
+    const size_t start = run.start;
+    const size_t end = ( run.start + run.length );
+    auto unitAt = [this]( size_t i ) -> Codepoint {
+      return ( encoding_ == Encoding_UTF8 ? static_cast<uint8_t>( utf8_[i] ) : static_cast<Codepoint>( utf16_[i] ) );
+    };
 
-    const auto ascender = fce->ascender();
-    const auto descender = fce->descender();
+    for ( size_t i = start; i < end; ++i )
+      if ( unitAt( i ) >= BasicLatinTable::c_count )
+        return false;
 
-    position.y += ascender + descender;
+    auto face = run.face;
+    const auto& table = face->basicLatin();
 
-    unsigned int glyphCount;
-    auto info = hb_buffer_get_glyph_infos( hbbuf_, &glyphCount );
-    auto gpos = hb_buffer_get_glyph_positions( hbbuf_, &glyphCount );
+    for ( size_t i = start; i < end; ++i )
+      if ( !table.simple[unitAt( i )] )
+        return false;
+
+    const auto base = shaped_.size();
+    shaped_.resize( base + run.length );
+    for ( size_t i = start; i < end; ++i )
+    {
+      const auto cp = unitAt( i );
+      hb_position_t advance = table.advances[cp];
+      // Shaping doesn't kern across run boundaries either
+      if ( ( i + 1 ) < end )
+      {
+        const auto kern = face->basicLatinKern( cp, unitAt( i + 1 ) );
+        if ( kern == BasicLatinTable::c_complexPair )
+          return false;
+        advance += kern;
+      }
+      auto& shaped = shaped_[base + ( i - start )];
+      shaped.index = table.glyphs[cp];
+      shaped.cluster = static_cast<uint32_t>( i );
+      shaped.run = runIndex;
+      shaped.offset = vec2( 0.0f );
+      shaped.advance = vec2( static_cast<Real>( advance ) / c_fmagic, 0.0f );
+      shaped.newline = ( shaped.index == 0 && ( cp == '\n' || cp == '\r' ) );
+      shaped.breakBefore = false;
+      shaped.whitespace = false;
+    }
 
-    mesh_.vertices_.clear();
-    mesh_.indices_.clear();
+    rightToLeft_ = false;
+    return true;
+  }
 
+  void TextImpl::shapeHarfBuzz( uint32_t runIndex, hb_direction_t direction )
+  {
+    const auto& run = shapingRuns_[runIndex];
+
+    ShapingBuffer buffer( manager_ );
+    auto hbbuf = buffer.get();
+
+    // The rest of the text is still there as context for the shaper
+    uint32_t flags = hb_buffer_get_flags( hbbuf );
+    if ( run.start == 0 )
+      flags |= HB_BUFFER_FLAG_BOT;
+    if ( run.start + run.length == textLength_ )
+      flags |= HB_BUFFER_FLAG_EOT;
+    hb_buffer_set_flags( hbbuf, static_cast<hb_buffer_flags_t>( flags ) );
+
+    if ( encoding_ == Encoding_UTF8 )
+    {
+      auto length = static_cast<int>( utf8_.size() );
+      hb_buffer_add_utf8( hbbuf, utf8_.data(), length, run.start, static_cast<int>( run.length ) );
+    }
+    else
+    {
+      auto length = static_cast<int>( utf16_.size() );
+      hb_buffer_add_utf16( hbbuf, reinterpret_cast<const uint16_t*>( utf16_.data() ), length, run.start, static_cast<int>( run.length ) );
+    }
+
+    // Anything left unset is guessed from the text itself
+    hb_buffer_set_direction( hbbuf, direction );
+    hb_buffer_set_script( hbbuf, script_ );
+    hb_buffer_set_language( hbbuf, language_ );
+    hb_buffer_guess_segment_properties( hbbuf );
+
+    hb_segment_properties_t props;
+    hb_buffer_get_segment_properties( hbbuf, &props );
+
+    auto plan = run.face->shapePlan( props, features_, featuresHash_ );
+    if ( !hb_shape_plan_execute( plan, run.face->hbfnt_, hbbuf,
+      features_.empty() ? nullptr : features_.data(), static_cast<unsigned int>( features_.size() ) ) )
+      NEWTYPE_EXCEPT( "HarfBuzz shaping failed" );
+
+    unsigned int glyphCount;
+    auto info = hb_buffer_get_glyph_infos( hbbuf, &glyphCount );
+    auto gpos = hb_buffer_get_glyph_positions( hbbuf, &glyphCount );
+
+    // Keep only what mesh generation needs; the buffer goes back to the pool
+    const auto base = shaped_.size();
+    shaped_.resize( base + glyphCount );
     for ( unsigned int i = 0; i < glyphCount; ++i )
     {
-      auto codepoint = text_.charAt( i );
-      auto glyphindex = info[i].codepoint;
-      const auto chartype = u_charType( codepoint );
-      if ( chartype == U_CONTROL_CHAR && glyphindex == 0 )
+      auto& shaped = shaped_[base + i];
+      shaped.index = info[i].codepoint;
+      shaped.cluster = info[i].cluster;
+      shaped.run = runIndex;
+      shaped.offset = vec2( gpos[i].x_offset, gpos[i].y_offset ) / c_fmagic;
+      shaped.advance = vec2( gpos[i].x_advance, gpos[i].y_advance ) / c_fmagic;
+      shaped.newline = ( shaped.index == 0 && u_charType( codepointAt( shaped.cluster ) ) == U_CONTROL_CHAR );
+      shaped.breakBefore = false;
+      shaped.whitespace = false;
+    }
+
+    rightToLeft_ = HB_DIRECTION_IS_BACKWARD( props.direction );
+  }
+
+  // Everything layout and mesh building take from shaping
+  inline bool sameShaping( const ShapedGlyph& a, const ShapedGlyph& b )
+  {
+    return ( a.index == b.index && a.cluster == b.cluster && a.offset == b.offset && a.advance == b.advance && a.newline == b.newline );
+  }
+
+  void TextImpl::shapeRun( uint32_t runIndex, hb_direction_t direction )
+  {
+    NEWTYPE_PROFILE( manager_, ProfileZone_Shape );
+    const auto base = shaped_.size();
+    if ( shapeBasicLatin( runIndex, direction ) )
+    {
+#ifdef NEWTYPE_VERIFY_FASTPATH
+      static thread_local ShapedGlyphs fast;
+      fast.assign( shaped_.begin() + base, shaped_.end() );
+      shaped_.resize( base );
+      shapeHarfBuzz( runIndex, direction );
+      assert( fast.size() == ( shaped_.size() - base ) );
+      for ( size_t i = 0; i < fast.size(); ++i )
+        assert( sameShaping( fast[i], shaped_[base + i] ) );
+#endif
+      return;
+    }
+    shaped_.resize( base );
+    shapeHarfBuzz( runIndex, direction );
+  }
+
+  FastPathCheck TextImpl::checkFastPath()
+  {
+    FastPathCheck check;
+    if ( !resolveRuns() )
+      return check;
+
+    for ( uint32_t i = 0; i < shapingRuns_.size(); ++i )
+    {
+      shaped_.clear();
+      if ( !shapeBasicLatin( i, direction_ ) )
+        continue;
+      const ShapedGlyphs fast( shaped_ );
+      shaped_.clear();
+      shapeHarfBuzz( i, direction_ );
+
+      ++check.runs;
+      check.glyphs += fast.size();
+      const auto common = std::min( fast.size(), shaped_.size() );
+      for ( size_t j = 0; j < common; ++j )
+        if ( !sameShaping( fast[j], shaped_[j] ) )
+          ++check.mismatches;
+      check.mismatches += ( std::max( fast.size(), shaped_.size() ) - common );
+    }
+
+    // What the last update shaped is gone now
+    dirty_ = true;
+    return check;
+  }
+
+  void TextImpl::shape()
+  {
+    shaped_.clear();
+
+    // Without bidi analysis the whole text goes one way, as resolved for its first run
+    auto direction = direction_;
+    for ( uint32_t i = 0; i < shapingRuns_.size(); ++i )
+    {
+      shapeRun( i, direction );
+      direction = ( rightToLeft_ ? HB_DIRECTION_RTL : HB_DIRECTION_LTR );
+    }
+
+    // Each run came out in visual order; for right-to-left text the runs themselves go last to first,
+    // so flip everything and then put each run's own glyphs back the way they were
+    if ( rightToLeft_ && shapingRuns_.size() > 1 )
+    {
+      std::reverse( shaped_.begin(), shaped_.end() );
+      for ( auto first = shaped_.begin(); first != shaped_.end(); )
       {
-        position.x = pen_.x;
-        position.y += ( fce->ascender() - fce->descender() );
+        auto last = std::find_if( first, shaped_.end(), [first]( const ShapedGlyph& glyph ) { return glyph.run != first->run; } );
+        std::reverse( first, last );
+        first = last;
+      }
+    }
+  }
+
+  // Per-thread UText for line breaking. Opening one over UTF-8 allocates its buffers
+  // and closing it frees them, so it's only closed when the thread goes; reopening reuses them.
+  struct BreakText {
+    UText text = UTEXT_INITIALIZER;
+    ~BreakText() { utext_close( &text ); }
+  };
+
+  static thread_local BreakText t_breakText;
+
+  void TextImpl::findBreaks()
+  {
+    LineBreaker breaker( manager_ );
+    auto iterator = breaker.get();
+
+    UErrorCode status = U_ZERO_ERROR;
+    auto utext = &t_breakText.text;
+    if ( encoding_ == Encoding_UTF8 )
+      utext_openUTF8( utext, utf8_.data(), static_cast<int64_t>( utf8_.size() ), &status );
+    else
+      utext_openUChars( utext, utf16_.data(), static_cast<int64_t>( utf16_.size() ), &status );
+    iterator->setText( utext, status );
+    if ( U_FAILURE( status ) )
+      NEWTYPE_EXCEPT( "ICU line break analysis failed" );
+
+    // UText native indices are in code units of the source encoding, same as HarfBuzz clusters.
+    // Both only grow in logical order, so one merged walk does it.
+    const auto count = shaped_.size();
+    auto boundary = iterator->first();
+    auto previousCluster = numeric_limits<uint32_t>::max();
+    for ( size_t i = 0; i < count; ++i )
+    {
+      auto& glyph = shaped_[rightToLeft_ ? ( count - 1 - i ) : i];
+      glyph.whitespace = u_isWhitespace( codepointAt( glyph.cluster ) );
+      glyph.breakBefore = false;
+      if ( glyph.cluster == previousCluster )
+        continue;
+      previousCluster = glyph.cluster;
+      while ( boundary != icu::BreakIterator::DONE && boundary < static_cast<int32_t>( glyph.cluster ) )
+        boundary = iterator->next();
+      glyph.breakBefore = ( boundary == static_cast<int32_t>( glyph.cluster ) );
+    }
+
+    breaksValid_ = true;
+  }
+
+  void TextImpl::layout()
+  {
+    NEWTYPE_PROFILE( manager_, ProfileZone_Layout );
+    const bool wrapping = ( wrapWidth_ > 0.0f );
+    if ( wrapping && !breaksValid_ )
+      findBreaks();
+
+    const auto count = static_cast<uint32_t>( shaped_.size() );
+    auto logical = [this, count]( uint32_t i ) -> const ShapedGlyph& {
+      return shaped_[rightToLeft_ ? ( count - 1 - i ) : i];
+    };
+
+    lines_.clear();
+    positions_.resize( count );
+
+    // Lines are found in logical order, and a logical range is a visual range too
+    // since a text is shaped as a single direction run
+    Real widest = 0.0f;
+    auto closeLine = [&]( uint32_t start, uint32_t end ) {
+      Real width = 0.0f;
+      Real trailing = 0.0f;
+      for ( auto i = start; i < end; ++i )
+      {
+        const auto& glyph = logical( i );
+        width += glyph.advance.x;
+        trailing = ( glyph.whitespace ? trailing + glyph.advance.x : 0.0f );
+      }
+      TextLine line;
+      line.first = ( rightToLeft_ ? ( count - end ) : start );
+      line.count = ( end - start );
+      line.width = ( width - trailing );
+      line.baseline = 0.0f;
+      lines_.push_back( line );
+      widest = glm::max( widest, line.width );
+    };
+
+    uint32_t start = 0;
+    uint32_t lastBreak = 0;
+    Real width = 0.0f;
+    for ( uint32_t i = 0; i < count; ++i )
+    {
+      const auto& glyph = logical( i );
+      if ( glyph.newline )
+      {
+        closeLine( start, i );
+        start = lastBreak = ( i + 1 );
+        width = 0.0f;
+        continue;
+      }
+      if ( wrapping && glyph.breakBefore && i > start )
+        lastBreak = i;
+      width += glyph.advance.x;
+      // Whitespace is allowed to hang past the edge
+      if ( wrapping && !glyph.whitespace && width > wrapWidth_ && lastBreak > start )
+      {
+        closeLine( start, lastBreak );
+        start = lastBreak;
+        width = 0.0f;
+        for ( auto j = start; j <= i; ++j )
+          width += logical( j ).advance.x;
+      }
+    }
+    closeLine( start, count );
+
+    const auto box = ( wrapping ? wrapWidth_ : widest );
+    const auto lineHeight = ( ascender_ - descender_ );
+    auto baseline = ( ascender_ + descender_ );
+
+    for ( auto& line : lines_ )
+    {
+      line.baseline = baseline;
+
+      auto x = 0.0f;
+      if ( alignment_ == TextAlignment_Center )
+        x = ( box - line.width ) * 0.5f;
+      else if ( alignment_ == TextAlignment_Right )
+        x = ( box - line.width );
+
+      // Trailing whitespace of a right-to-left line sits visually at its start
+      if ( rightToLeft_ )
+      {
+        for ( auto i = line.first; i < ( line.first + line.count ) && shaped_[i].whitespace; ++i )
+          x -= shaped_[i].advance.x;
+      }
+
+      auto position = vec2( x, baseline );
+      for ( auto i = line.first; i < ( line.first + line.count ); ++i )
+      {
+        positions_[i] = position;
+        position += shaped_[i].advance;
+      }
+
+      baseline += lineHeight;
+    }
+  }
+
+  // Per-thread scratch for the quads of the text being built, kept around between builds
+  static thread_local GlyphQuads t_quads;
+
+  pair<size_t, size_t> TextImpl::visibleLines() const
+  {
+    if ( !clipping_ )
+      return { 0, lines_.size() };
+
+    // Only lines that may reach into the clip rectangle are looked at, so the cost follows what's visible.
+    // Line tests are padded by a line height for glyphs poking out of the face metrics.
+    const auto pen = penOffset();
+    const auto lineHeight = ( ascender_ - descender_ );
+    const auto top = ( clipRect_.y - pen.y );
+    const auto bottom = ( clipRect_.w - pen.y );
+    auto first = std::partition_point( lines_.begin(), lines_.end(), [&]( const TextLine& line ) {
+      return ( line.baseline - descender_ + lineHeight ) < top;
+    } );
+    auto end = std::partition_point( first, lines_.end(), [&]( const TextLine& line ) {
+      return ( line.baseline - ascender_ - lineHeight ) <= bottom;
+    } );
+    return { static_cast<size_t>( first - lines_.begin() ), static_cast<size_t>( end - lines_.begin() ) };
+  }
+
+  void TextImpl::gatherQuads( const vec3& origin, const Texture* texture, GlyphQuads& quads, MeshGroups* groups )
+  {
+    if ( groups )
+      groups->clear();
+
+    const auto visible = visibleLines();
+    const auto firstLine = lines_.begin() + visible.first;
+    const auto endLine = lines_.begin() + visible.second;
+
+    // Clip rectangle relative to the mesh
+    vec4 clip( 0.0f );
+    if ( clipping_ )
+    {
+      const auto pen = penOffset();
+      const auto shift = vec2( origin.x - pen.x, origin.y - pen.y );
+      clip = clipRect_ + vec4( shift.x, shift.y, shift.x, shift.y );
+    }
+
+    // Sized once for everything that might make it in and trimmed at the end,
+    // so there are no per-glyph capacity checks
+    size_t bound = 0;
+    for ( auto line = firstLine; line != endLine; ++line )
+      bound += line->count;
+    manager_->reserveQuadScratch( quads, bound, shapingRuns_.size() );
+    quads.resize( bound );
+
+    quads.palette.resize( shapingRuns_.size() );
+    quads.packedPalette.resize( shapingRuns_.size() );
+    for ( size_t i = 0; i < shapingRuns_.size(); ++i )
+    {
+      quads.palette[i] = shapingRuns_[i].color;
+      quads.packedPalette[i] = packColor( shapingRuns_[i].color );
+    }
+
+    // Grouped by texture so that each group draws with one texture bound.
+    // Only the glyph lookups happen here; the corner math runs over whole groups afterwards.
+    size_t count = 0;
+    for ( uint32_t group = 0; group < groups_.size(); ++group )
+    {
+      const auto& groupTexture = groups_[group]->texture();
+      if ( texture && texture != &groupTexture )
         continue;
+
+      const auto first = count;
+      for ( auto line = firstLine; line != endLine; ++line )
+      {
+        for ( auto i = line->first; i < ( line->first + line->count ); ++i )
+        {
+          const auto& shaped = shaped_[i];
+          const auto& run = shapingRuns_[shaped.run];
+          if ( run.group != group )
+            continue;
+          auto glyph = run.style->getGlyph( manager_->ft(), run.face->face_, shaped.index );
+          const auto position = vec2( origin.x, origin.y ) + positions_[i];
+
+          quads.originX[count] = ( position.x + shaped.offset.x );
+          quads.originY[count] = ( position.y - shaped.offset.y );
+          quads.bearingX[count] = static_cast<Real>( glyph->bearing.x );
+          quads.bearingY[count] = static_cast<Real>( glyph->bearing.y );
+          quads.width[count] = static_cast<Real>( glyph->width );
+          quads.height[count] = static_cast<Real>( glyph->height );
+          quads.u0[count] = glyph->coords[0].x;
+          quads.v0[count] = glyph->coords[0].y;
+          quads.u1[count] = glyph->coords[1].x;
+          quads.v1[count] = glyph->coords[1].y;
+          quads.color[count] = shaped.run;
+          ++count;
+        }
+      }
+
+      computeQuadCorners( quads, first, count );
+      if ( clipping_ )
+        count = clipQuads( quads, first, count, clip );
+
+      if ( groups && count > first )
+        groups->push_back( { &groupTexture, first, ( count - first ) } );
+    }
+
+    quads.resize( count );
+  }
+
+  void TextImpl::buildMesh()
+  {
+    NEWTYPE_PROFILE( manager_, ProfileZone_BuildMesh );
+    // With buffering the mesh goes into the slot the render thread isn't looking at
+    auto& mesh = ( buffers_ ? ( *buffers_ )[writeSlot_] : mesh_ );
+    mesh.format_ = format_;
+    mesh.sharedIndices_ = sharedIndices_;
+    mesh.dirty_ = true;
+
+    // Build relative to the pen unless it's to be baked into the vertices
+    origin_ = ( bakesPen() ? penOffset() : vec3( 0.0f ) );
+    mesh.translation_ = ( bakesPen() ? vec3( 0.0f ) : penOffset() );
+
+    auto& quads = t_quads;
+    gatherQuads( origin_, nullptr, quads, &mesh.groups_ );
+
+    const auto format = mesh.format_;
+    const auto elements = ( quads.size() * meshElementsPerQuad( format ) );
+
+    // Only keep storage for the format in use
+    uint8_t* destination = nullptr;
+    if ( format == MeshFormat_Quads )
+    {
+      mesh.vertices_.resize( elements, Vertex( vec3( 0.0f ), vec2( 0.0f ), vec4( 0.0f ) ) );
+      destination = reinterpret_cast<uint8_t*>( mesh.vertices_.data() );
+    }
+    else
+      releaseStorage( mesh.vertices_ );
+    if ( format == MeshFormat_CompactQuads )
+    {
+      mesh.compactVertices_.resize( elements );
+      destination = reinterpret_cast<uint8_t*>( mesh.compactVertices_.data() );
+    }
+    else
+      releaseStorage( mesh.compactVertices_ );
+    if ( format == MeshFormat_Instances )
+    {
+      mesh.instances_.resize( elements );
+      destination = reinterpret_cast<uint8_t*>( mesh.instances_.data() );
+    }
+    else
+      releaseStorage( mesh.instances_ );
+
+    expandQuads( quads, 0, quads.size(), format, origin_.z, destination );
+
+    const bool indexed = ( format != MeshFormat_Instances && !mesh.sharedIndices_ );
+    if ( indexed )
+    {
+      mesh.indices_.clear();
+      for ( size_t i = 0; i < quads.size(); ++i )
+        appendQuadIndices( mesh.indices_, static_cast<VertexIndex>( i * 4 ) );
+    }
+    else
+      releaseStorage( mesh.indices_ );
+
+    // The mesh keeps the pattern it was built against, so a buffered slot stays drawable while the manager's grows
+    if ( mesh.sharedIndices_ && format != MeshFormat_Instances )
+      mesh.quadIndices_ = manager_->reserveQuadIndices( quads.size() );
+    else
+      mesh.quadIndices_.reset();
+
+    if ( buffers_ )
+      publish();
+  }
+
+  bool TextImpl::prepare()
+  {
+    // Already done by stageUpdate()
+    if ( staged_ )
+      return true;
+
+    // Also checks that every face in use is loaded
+    if ( !resolveRuns() )
+      return false;
+
+    // Wrap width and alignment changes only need a new layout on top of the same shaping
+    if ( dirty_ )
+    {
+      shape();
+      breaksValid_ = false;
+    }
+
+    if ( dirty_ || layoutDirty_ )
+      layout();
+
+    return true;
+  }
+
+  void TextImpl::regenerate()
+  {
+    if ( !needsRebuild() || !prepare() )
+      return;
+
+    buildMesh();
+
+    dirty_ = false;
+    layoutDirty_ = false;
+    meshDirty_ = false;
+    meshStale_ = false;
+    penDirty_ = false;
+    staged_ = false;
+  }
+
+  void TextImpl::stageUpdate()
+  {
+    staged_ = false;
+    misses_.clear();
+    if ( !needsRebuild() || !prepare() )
+      return;
+
+    const auto visible = visibleLines();
+    for ( auto line = visible.first; line < visible.second; ++line )
+    {
+      for ( auto i = lines_[line].first; i < ( lines_[line].first + lines_[line].count ); ++i )
+      {
+        const auto& run = shapingRuns_[shaped_[i].run];
+        if ( !run.style->hasGlyph( shaped_[i].index ) )
+          misses_.push_back( { run.face, run.style, shaped_[i].index } );
       }
-      auto glyph = style->getGlyph( manager_->ft(), fce->face_, glyphindex );
-      auto offset = vec2( gpos[i].x_offset, gpos[i].y_offset ) / c_fmagic;
-      auto advance = vec2( gpos[i].x_advance, gpos[i].y_advance ) / c_fmagic;
+    }
+
+    staged_ = true;
+  }
+
+  void TextImpl::loadMissingGlyphs()
+  {
+    // Atlases first drawn now are made here, so the host hears about them on the calling thread
+    if ( staged_ )
+      for ( auto style : groups_ )
+        style->texture();
+    // Repeats are found in the cache by the time they come up again
+    for ( const auto& miss : misses_ )
+      miss.style->getGlyph( manager_->ft(), miss.face->face_, miss.index );
+    misses_.clear();
+  }
 
-      auto p0 = vec2(
-        ( position.x + offset.x + glyph->bearing.x ),
-        ifloor( position.y - offset.y - glyph->bearing.y ) );
+  void TextImpl::finishUpdate()
+  {
+    if ( staged_ )
+      regenerate();
+    else if ( penDirty_ )
+      reposition();
+  }
 
-      auto p1 = vec2(
-        ( p0.x + glyph->width ),
-        (int)( p0.y + glyph->height ) );
+  void TextImpl::unstage()
+  {
+    staged_ = false;
+    misses_.clear();
+  }
 
-      auto color = vec4( 1.0f, 1.0f, 1.0f, 1.0f );
+  size_t TextImpl::updateInto( span<uint8_t> destination, MeshSink* sink )
+  {
+    if ( batch_ )
+      NEWTYPE_EXCEPT( "Batched texts are updated by their batch" );
+    return writeMesh( destination, sink, nullptr );
+  }
 
-      auto index = static_cast<VertexIndex>( mesh_.vertices_.size() );
-      mesh_.vertices_.emplace_back( vec3( p0.x, p0.y, position.z ), vec2( glyph->coords[0].x, glyph->coords[0].y ), color );
-      mesh_.vertices_.emplace_back( vec3( p0.x, p1.y, position.z ), vec2( glyph->coords[0].x, glyph->coords[1].y ), color );
-      mesh_.vertices_.emplace_back( vec3( p1.x, p1.y, position.z ), vec2( glyph->coords[1].x, glyph->coords[1].y ), color );
-      mesh_.vertices_.emplace_back( vec3( p1.x, p0.y, position.z ), vec2( glyph->coords[1].x, glyph->coords[0].y ), color );
+  size_t TextImpl::writeMesh( span<uint8_t> destination, MeshSink* sink, const Texture* texture )
+  {
+    if ( !prepare() )
+      return 0;
+
+    NEWTYPE_PROFILE( manager_, ProfileZone_BuildMesh );
+
+    const auto origin = ( bakesPen() ? penOffset() : vec3( 0.0f ) );
+    mesh_.translation_ = ( bakesPen() ? vec3( 0.0f ) : penOffset() );
 
-      Indices idcs = { index + 0, index + 1, index + 2, index + 0, index + 2, index + 3 };
-      mesh_.indices_.insert( mesh_.indices_.end(), idcs.begin(), idcs.end() );
+    auto& quads = t_quads;
+    gatherQuads( origin, texture, quads, texture ? nullptr : &mesh_.groups_ );
 
-      position += vec3( advance, 0.0f );
+    const auto format = format_;
+    const auto elementSize = meshElementSize( format );
+    const auto perQuad = meshElementsPerQuad( format );
+
+    size_t written = 0;
+    size_t done = 0;
+    while ( done < quads.size() )
+    {
+      const auto fits = std::min( destination.size() / ( elementSize * perQuad ), quads.size() - done );
+      if ( fits == 0 )
+      {
+        if ( !sink )
+          break;
+        destination = sink->newtypeMeshSpace( *this, written, ( quads.size() - done ) * perQuad );
+        if ( destination.size() < ( elementSize * perQuad ) )
+          break;
+        continue;
+      }
+      expandQuads( quads, done, fits, format, origin.z, destination.data() );
+      destination = destination.subspan( fits * elementSize * perQuad );
+      done += fits;
+      written += ( fits * perQuad );
     }
 
+    // The host draws these with Manager::quadIndices() whether the text shares indices or not
+    if ( format != MeshFormat_Instances )
+      manager_->reserveQuadIndices( quads.size() );
+
+    // The host's copy is now the current one. mesh() isn't kept up to date alongside it, apart from
+    // groups_ which describe the written ranges, so the next update() builds it again in full
     dirty_ = false;
+    layoutDirty_ = false;
+    meshDirty_ = false;
+    meshStale_ = true;
+    penDirty_ = false;
+    staged_ = false;
+
+    return written;
+  }
+
+  bool TextImpl::bakesPen() const
+  {
+    // Compact vertices have neither the range nor the depth to carry the pen
+    return ( penMode_ == PenMode_Baked && format_ != MeshFormat_CompactQuads );
+  }
+
+  vec3 TextImpl::penOffset() const
+  {
+    // Glyph tops are snapped to whole pixels, so only move vertically by whole pixels
+    return vec3( pen_.x, ifloor( pen_.y ), pen_.z );
+  }
+
+  void TextImpl::reposition()
+  {
+    // Published meshes are never touched again, so buffered texts build a new one instead
+    if ( buffers_ )
+    {
+      meshDirty_ = true;
+      regenerate();
+      return;
+    }
+
+    mesh_.dirty_ = true;
+    if ( bakesPen() )
+    {
+      const auto offset = penOffset();
+      const auto delta = offset - origin_;
+      for ( auto& vertex : mesh_.vertices_ )
+        vertex.position = vertex.position + delta;
+      for ( auto& instance : mesh_.instances_ )
+        instance.position = instance.position + delta;
+      origin_ = offset;
+      mesh_.translation_ = vec3( 0.0f );
+    }
+    else
+    {
+      for ( auto& vertex : mesh_.vertices_ )
+        vertex.position = vertex.position - origin_;
+      for ( auto& instance : mesh_.instances_ )
+        instance.position = instance.position - origin_;
+      origin_ = vec3( 0.0f );
+      mesh_.translation_ = penOffset();
+    }
+
+    penDirty_ = false;
+  }
+
+  bool TextImpl::needsRebuild() const
+  {
+    return ( dirty_ || layoutDirty_ || meshDirty_ || meshStale_ );
   }
 
   void TextImpl::update()
   {
-    regenerate();
+    // Would clear the dirty flags the batch goes by, leaving its copy of the text stale
+    if ( batch_ )
+      NEWTYPE_EXCEPT( "Batched texts are updated by their batch" );
+    if ( needsRebuild() )
+      regenerate();
+    else if ( penDirty_ )
+      reposition();
   }
 
   const Mesh& TextImpl::mesh() const
   {
-    return mesh_;
+    return ( buffers_ ? ( *buffers_ )[publishedSlot_] : mesh_ );
+  }
+
+  void TextImpl::publish()
+  {
+    // Hand the finished slot over and take back whichever one was waiting in the middle
+    publishedSlot_ = writeSlot_;
+    writeSlot_ = ( sharedSlot_.exchange( writeSlot_ | c_freshSlot, std::memory_order_acq_rel ) & ~c_freshSlot );
+  }
+
+  const Mesh& TextImpl::consumeMesh()
+  {
+    if ( !buffers_ )
+      return mesh_;
+    if ( sharedSlot_.load( std::memory_order_relaxed ) & c_freshSlot )
+      readSlot_ = ( sharedSlot_.exchange( readSlot_, std::memory_order_acq_rel ) & ~c_freshSlot );
+    return ( *buffers_ )[readSlot_];
+  }
+
+  bool TextImpl::meshBuffering() const
+  {
+    return ( buffers_ != nullptr );
+  }
+
+  void TextImpl::meshBuffering( bool enabled )
+  {
+    if ( enabled == meshBuffering() )
+      return;
+    if ( enabled )
+    {
+      buffers_ = make_unique<array<Mesh, 3>>();
+      writeSlot_ = 0;
+      sharedSlot_ = 1;
+      readSlot_ = 2;
+      publishedSlot_ = 2; // empty until the first publish
+    }
+    else
+      buffers_.reset();
+    meshDirty_ = true;
   }
 
   vec3 TextImpl::pen() const
@@ -169,12 +1015,125 @@ namespace newtype {
     if ( epsilonCompare( pen, pen_ ) )
       return;
     pen_ = pen;
-    dirty_ = true;
+    penDirty_ = true;
+    // What's inside the clip rectangle changes with the pen
+    if ( clipping_ )
+      meshDirty_ = true;
+  }
+
+  PenMode TextImpl::penMode() const
+  {
+    return penMode_;
+  }
+
+  void TextImpl::penMode( PenMode mode )
+  {
+    if ( mode == penMode_ )
+      return;
+    if ( batch_ )
+      NEWTYPE_EXCEPT( "Batched texts keep their pen baked" );
+    penMode_ = mode;
+    penDirty_ = true;
+  }
+
+  MeshFormat TextImpl::meshFormat() const
+  {
+    return format_;
+  }
+
+  void TextImpl::meshFormat( MeshFormat format )
+  {
+    if ( format == format_ )
+      return;
+    if ( batch_ )
+      NEWTYPE_EXCEPT( "Batched texts keep their batch's mesh format" );
+    format_ = format;
+    meshDirty_ = true;
+  }
+
+  bool TextImpl::sharedIndices() const
+  {
+    return sharedIndices_;
+  }
+
+  void TextImpl::sharedIndices( bool shared )
+  {
+    if ( shared == sharedIndices_ )
+      return;
+    sharedIndices_ = shared;
+    meshDirty_ = true;
+  }
+
+  Real TextImpl::wrapWidth() const
+  {
+    return wrapWidth_;
+  }
+
+  void TextImpl::wrapWidth( Real width )
+  {
+    width = glm::max( width, 0.0f );
+    if ( width == wrapWidth_ )
+      return;
+    wrapWidth_ = width;
+    layoutDirty_ = true;
+  }
+
+  TextAlignment TextImpl::alignment() const
+  {
+    return alignment_;
+  }
+
+  void TextImpl::alignment( TextAlignment alignment )
+  {
+    if ( alignment == alignment_ )
+      return;
+    alignment_ = alignment;
+    layoutDirty_ = true;
+  }
+
+  vec4 TextImpl::color() const
+  {
+    return color_;
+  }
+
+  void TextImpl::color( const vec4& color )
+  {
+    if ( color == color_ )
+      return;
+    color_ = color;
+    meshDirty_ = true;
+  }
+
+  vec4 TextImpl::clipRect() const
+  {
+    return clipRect_;
+  }
+
+  void TextImpl::clipRect( const vec4& rect )
+  {
+    if ( clipping_ && rect == clipRect_ )
+      return;
+    clipRect_ = rect;
+    clipping_ = true;
+    meshDirty_ = true;
+  }
+
+  bool TextImpl::clipping() const
+  {
+    return clipping_;
+  }
+
+  void TextImpl::clipping( bool enabled )
+  {
+    if ( enabled == clipping_ )
+      return;
+    clipping_ = enabled;
+    meshDirty_ = true;
   }
 
   bool TextImpl::dirty() const
   {
-    return dirty_;
+    return ( dirty_ || layoutDirty_ || meshDirty_ || penDirty_ );
   }
 
   FontFacePtr TextImpl::face()
@@ -168,6 +168,17 @@ namespace newtype {
     return move( region );
   }
 
+  Real TextureAtlas::fragmentation() const
+  {
+    // Packing only ever places above the skyline, so whatever below it isn't used is lost
+    size_t below = 0;
+    for ( const auto& node : nodes_ )
+      below += static_cast<size_t>( node.z ) * static_cast<size_t>( node.y - 1 );
+    if ( below == 0 || used_ >= below )
+      return 0.0f;
+    return static_cast<Real>( below - used_ ) / static_cast<Real>( below );
+  }
+
   void TextureAtlas::clear()
   {
     vec3i node( 1 );